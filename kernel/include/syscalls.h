@@ -1299,10 +1299,23 @@ int __sys_setsockopt(int fd, int level, int optname, char __user *optval,
 asmlinkage long sys_demosystemcall(void);
 
 /* message queue */
-asmlinkage long sys_create_queue(unsigned int queueId);
+struct MessageDescriptor;
+struct MessageInfo;
+struct MessageVector;
+asmlinkage long sys_create_queue(unsigned int queueId, unsigned int depth, unsigned int flags);
 asmlinkage long sys_delete_queue(unsigned int queueId);
 asmlinkage long sys_msg_send(unsigned int queueId, char * message, unsigned int length);
 asmlinkage long sys_msg_receive(unsigned int queueId, char * buffer, unsigned int * length);
-asmlinkage long sys_msg_ack(unsigned int queueId);
+asmlinkage long sys_msg_ack(unsigned int queueId, unsigned long sequence);
+asmlinkage long sys_msg_send_batch(struct MessageDescriptor __user * descriptors, unsigned int count);
+asmlinkage long sys_msg_receive_batch(unsigned int queueId, struct MessageVector __user * vector, unsigned int count, unsigned int __user * received);
+asmlinkage long sys_msg_open(unsigned int queueId, unsigned int flags);
+asmlinkage long sys_msg_ring_notify(unsigned int queueId, unsigned int op, unsigned int value);
+asmlinkage long sys_msg_queue_ctl(unsigned int queueId, unsigned int cmd, unsigned long arg);
+asmlinkage long sys_msg_send_timed(unsigned int queueId, char __user * message, unsigned int length, unsigned int priority, const struct __kernel_timespec __user * abs_timeout);
+asmlinkage long sys_msg_receive_timed(unsigned int queueId, char __user * buffer, unsigned int __user * length, unsigned int __user * priority, const struct __kernel_timespec __user * abs_timeout);
+asmlinkage long sys_queue_set_ctl(unsigned int setId, unsigned int cmd, unsigned int queueId);
+asmlinkage long sys_msg_receive_any(unsigned int setId, char __user * buffer, unsigned int __user * length, unsigned int __user * queueId);
+asmlinkage long sys_msg_receive_ext(unsigned int queueId, char __user * buffer, unsigned int capacity, struct MessageInfo __user * info, const struct __kernel_timespec __user * abs_timeout);
 
 #endif
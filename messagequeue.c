@@ -1,313 +1,4211 @@
 #include <linux/kernel.h>
 #include <linux/syscalls.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+#include <linux/rhashtable.h>
+#include <linux/refcount.h>
+#include <linux/rcupdate.h>
+#include <linux/mempool.h>
+#include <linux/mm.h>
+#include <linux/jump_label.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/anon_inodes.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/sched/signal.h>
+#include <linux/time64.h>
+#include <linux/highmem.h>
+#include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/pid_namespace.h>
+#include <linux/log2.h>
+#include <linux/sched/mm.h>
+#include <linux/capability.h>
+
+#define CREATE_TRACE_POINTS
+#include "messagequeue_trace.h"
 
 #define MESSAGE_MAX 256
 #define QUEUE_MAX 10
-#define DEBUG
+#define QUEUE_DEPTH_MAX 4096
+
+/* Message priorities run from 0 to MQ_PRIO_MAX - 1; higher is received first. */
+#define MQ_PRIO_MAX 32u
+
+/* create_queue flags */
+#define MQ_FLAG_PREALLOC 0x1u
+#define MQ_FLAG_SHARED 0x2u
+#define MQ_FLAG_NONBLOCK 0x4u
+#define MQ_FLAG_SHARDED 0x8u
+#define MQ_FLAG_ORDERED 0x10u
+#define MQ_FLAGS_ALL (MQ_FLAG_PREALLOC | MQ_FLAG_SHARED | MQ_FLAG_NONBLOCK | MQ_FLAG_SHARDED | MQ_FLAG_ORDERED)
+
+/* Shared ring transport, see struct MessageRingHeader. */
+#define MQ_RING_MAGIC 0x4d51524eu
+#define MQ_RING_SLOT_SIZE 16384u
+
+/* msg_queue_ctl commands */
+#define MQ_CTL_SET_WINDOW 1u
+#define MQ_CTL_GET_WINDOW 2u
+#define MQ_CTL_SET_NONBLOCK 3u
+#define MQ_CTL_GET_NONBLOCK 4u
+#define MQ_CTL_SET_LATENCY 5u
+#define MQ_CTL_GET_LATENCY 6u
+
+/* queue_set_ctl commands */
+#define MQ_SET_CREATE 1u
+#define MQ_SET_DESTROY 2u
+#define MQ_SET_ADD 3u
+#define MQ_SET_REMOVE 4u
+
+/* msg_ring_notify operations */
+#define MQ_RING_WAIT_DATA 0u
+#define MQ_RING_WAIT_SPACE 1u
+#define MQ_RING_WAKE_CONSUMER 2u
+#define MQ_RING_WAKE_PRODUCER 3u
+
+/* Message buffers up to MESSAGE_MAX come from these slab size classes. */
+#define MESSAGE_CLASSES 3
+
+/* Plain queue messages longer than this are sent from the sender's pinned pages. */
+#define MESSAGE_PIN_MIN PAGE_SIZE
+
+/* No message may be longer than this, whatever path it takes into the queue. */
+#define MESSAGE_SIZE_MAX (64u << 20)
+
+/* Receives return the message length as an int. */
+static_assert(MESSAGE_SIZE_MAX <= INT_MAX);
+/*
+ * Debug output stays compiled in but costs a patched-out branch until it is
+ * enabled with messagequeue.debug=1 on the command line or at
+ * /sys/module/messagequeue/parameters/debug.
+ */
+static DEFINE_STATIC_KEY_FALSE(mqDebugKey);
+
+/*
+ * The lock contention profiler is off by default and is switched like debug
+ * output, with messagequeue.lockstat=1 or through
+ * /sys/module/messagequeue/parameters/lockstat. While off, every lock site
+ * is a patched-out branch in front of the plain lock call.
+ */
+static DEFINE_STATIC_KEY_FALSE(mqLockStatKey);
+
+#define LOG(m) \
+    do { \
+        if (static_branch_unlikely(&mqDebugKey)) \
+            printk(KERN_DEBUG "%s: %d : %s\n", __FILE__, __LINE__, m); \
+    } while (0)
+
+/*
+ * Every call returns E_OK on success and a negative errno on failure:
+ *   -ENOENT     the queue does not exist
+ *   -EAGAIN     the call would block and the queue or call is non-blocking
+ *   -ETIMEDOUT  the deadline of a timed call passed
+ *   -EIDRM      the queue was deleted while the caller was blocked
+ *   -EINTR      a signal arrived (blocking calls are restarted if possible)
+ *   -EMSGSIZE   the message is longer than MESSAGE_SIZE_MAX or does not fit
+ *               the slot or receive buffer
+ *   -EFAULT, -EINVAL, -ENOMEM with their usual meaning
+ */
+#define E_OK 0x0
+
+/* msg_send_batch and msg_receive_batch limits */
+#define MSG_BATCH_MAX 1024u
+#define MSG_BATCH_QUEUES 8u
+
+/* Boolean module parameters backed by a static key passed as kp->arg. */
+static int MessageQueueKeySet(const char *val, const struct kernel_param *kp)
+{
+    struct static_key_false * key = kp->arg;
+    bool enable;
+    int ret = kstrtobool(val, &enable);
+
+    if (0 == ret)
+    {
+        if (enable)
+        {
+            static_branch_enable(key);
+        }
+        else
+        {
+            static_branch_disable(key);
+        }
+    }
+
+    return ret;
+}
+
+static int MessageQueueKeyGet(char *buffer, const struct kernel_param *kp)
+{
+    struct static_key_false * key = kp->arg;
+
+    return sprintf(buffer, "%c\n", static_key_enabled(key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops mqKeyOps = {
+    .set = MessageQueueKeySet,
+    .get = MessageQueueKeyGet,
+};
+module_param_cb(debug, &mqKeyOps, &mqDebugKey, 0644);
+MODULE_PARM_DESC(debug, "Log every message queue operation to the kernel log");
+module_param_cb(lockstat, &mqKeyOps, &mqLockStatKey, 0644);
+MODULE_PARM_DESC(lockstat, "Profile lock contention, shown in /proc/messagequeue/locks");
+
+/*
+ * A message longer than MESSAGE_PIN_MIN on a plain queue, or one sent while
+ * a receiver is parked for a handoff, is normally not copied into the
+ * kernel. Once it has send credit, the sender pins the pages
+ * under its buffer long-term, queues a slot pointing at this descriptor and
+ * sleeps on wait until a receiver has copied the payload straight out of
+ * those pages, so the message needs no contiguous kernel allocation and is
+ * copied once. claimed and done are changed under queueLock: done with
+ * claimed still false means the queue was deleted before anyone received the
+ * message.
+ *
+ * The charged pages count against the sender's RLIMIT_MEMLOCK through
+ * mm->pinned_vm, like other long-term pins, and are uncharged from mm when
+ * the pages are unpinned. The sender and the queued slot each hold a
+ * reference, and the pages stay pinned until the last one is dropped, so a
+ * sender that is killed while a receiver is still copying the message out
+ * can leave at once.
+ */
+struct MessagePages
+{
+    refcount_t refs;
+    struct page ** pages;
+    struct mm_struct * mm;
+    unsigned int charged;
+    unsigned int count;
+    unsigned int offset;
+    bool claimed;
+    bool done;
+    wait_queue_head_t wait;
+};
+
+/*
+ * Metadata msg_receive_ext returns with each message. enqueueTime is the
+ * CLOCK_MONOTONIC time in nanoseconds at which the message was queued and
+ * sequence numbers messages in the order they were sent, from one, so gaps
+ * and reordering are visible without a payload header. ackSequence is the
+ * message's position in receive order, the number msg_ack takes to
+ * acknowledge it; it is 0 on sharded queues and shared rings, which need no
+ * msg_ack. Sharded queues number each shard on its own and report it in
+ * shard. Messages a shared ring producer wrote through the mapping carry no
+ * enqueueTime or tgid.
+ */
+struct MessageInfo
+{
+    __u64 enqueueTime;
+    __u64 sequence;
+    __u64 ackSequence;
+    __u32 length;
+    __u32 priority;
+    __s32 tgid;
+    __u32 shard;
+};
+
+/*
+ * Lock classes seen by the contention profiler. The first MQ_LOCK_SET
+ * classes belong to a queue and are also counted per queue; set locks only
+ * count towards the totals.
+ */
+enum
+{
+    MQ_LOCK_QUEUE,
+    MQ_LOCK_RING,
+    MQ_LOCK_SHARD,
+    MQ_LOCK_SET,
+    MQ_LOCK_CLASSES
+};
+
+static const char * const lockClassName[MQ_LOCK_CLASSES] = {"queue", "ring", "shard", "set"};
+
+/*
+ * A queue's contention profile for one lock class. Shard locks are many
+ * locks sharing one profile, so the counts are atomic; maxWaitNs is racy
+ * like peakDepth.
+ */
+struct MessageLockStats
+{
+    atomic64_t acquisitions;
+    atomic64_t contended;
+    atomic64_t waitNs;
+    u64 maxWaitNs;
+};
+
+/* Per-CPU totals per lock class over every queue and set. */
+struct MessageLockTotals
+{
+    u64 acquisitions;
+    u64 contended;
+    u64 waitNs;
+    u64 maxWaitNs;
+};
+
+static DEFINE_PER_CPU(struct MessageLockTotals, mqLockTotals[MQ_LOCK_CLASSES]);
+
+typedef struct
+{
+    unsigned int len;
+    unsigned int priority;
+    char * buffer;
+    struct MessagePages * pinned;
+    u64 enqueueTime;
+    unsigned long sequence;
+    unsigned long ackSequence;
+    pid_t tgid;
+    bool busy;
+    bool acked;
+    struct list_head node;
+}MessageSlot;
+
+/*
+ * A receiver about to sleep on an empty plain queue parks this descriptor
+ * on the queue's parked list. A sender that sees a receiver parked sends
+ * from its pinned pages like a large message. If the queue is still empty
+ * once the pages are pinned, it queues the message and claims it for the
+ * longest-parked receiver under the same queueLock hold, stores the claimed
+ * slot in slot and wakes just that task. The receiver copies the message
+ * out after the lock is dropped, straight from the sender's pages into its
+ * own buffer, so the message is copied once and needs no kernel buffer.
+ */
+struct MessageHandoff
+{
+    struct list_head node;
+    struct task_struct * task;
+    size_t capacity;
+    MessageSlot * slot;
+};
+
+/* One msg_send_batch entry; status is filled in by the kernel. */
+struct MessageDescriptor
+{
+    unsigned int queueId;
+    unsigned int length;
+    char __user * message;
+    int status;
+    unsigned int reserved;
+};
+
+/* One msg_receive_batch entry; length is filled in by the kernel. */
+struct MessageVector
+{
+    char __user * buffer;
+    unsigned int capacity;
+    unsigned int length;
+};
+
+/*
+ * Queues created with MQ_FLAG_SHARED keep their messages in a region that
+ * both peers map through the fd returned by msg_open. The first page holds
+ * this header, followed by slotCount slots of slotSize bytes, each starting
+ * with a struct MessageRingSlot. producer and consumer are free-running
+ * counts owned by the producer and consumer respectively and sit on their
+ * own cache lines. slotCount is a power of two, so an index maps to its
+ * slot as index & (slotCount - 1) and stays correct when the counts wrap.
+ * Payloads are written and read in place; the kernel is only entered
+ * through msg_ring_notify to sleep on or wake the peer.
+ *
+ * producerWaiters and consumerWaiters count tasks asleep in the kernel on
+ * each side. A peer that publishes an index only needs to issue a wake when
+ * the opposite count is non-zero after a full barrier, so the uncontended
+ * path never leaves user space.
+ *
+ * Either side may instead use msg_send or msg_receive, in which case the
+ * kernel acts as that side's producer or consumer and serializes concurrent
+ * callers. A side must not mix the mapping and the syscalls.
+ */
+struct MessageRingHeader
+{
+    __u32 magic;
+    __u32 slotSize;
+    __u32 slotCount;
+    __u32 dataOffset;
+    __u32 reserved0[12];
+    __u32 producer;
+    __u32 producerWaiters;
+    __u32 reserved1[14];
+    __u32 consumer;
+    __u32 consumerWaiters;
+    __u32 reserved2[14];
+};
+
+struct MessageRingSlot
+{
+    __u32 length;
+    __u32 reserved;
+};
+
+/*
+ * One per-CPU sub-ring of an MQ_FLAG_SHARDED queue, holding depth slots
+ * indexed like the queue's own ring. Producers use the shard of the CPU they
+ * run on, so its lock and indices normally stay in that CPU's cache; they
+ * only spill into other shards when their own is full.
+ */
+struct MessageShard
+{
+    spinlock_t lock;
+    unsigned long head;
+    unsigned long tail;
+    MessageSlot * slots;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Event counters, kept per CPU for every queue and once more for all queues
+ * together, so counting never bounces a cache line between CPUs. They are
+ * only summed when /proc/messagequeue is read. sends and receives count
+ * messages entering and leaving the queue and drops the messages still
+ * queued when it was deleted, so sends - receives - drops is the current
+ * depth; a blocked call counts once however often it wakes.
+ */
+struct MessageQueueStats
+{
+    u64 sends;
+    u64 receives;
+    u64 acks;
+    u64 sendBytes;
+    u64 receiveBytes;
+    u64 sendBlocks;
+    u64 receiveBlocks;
+    u64 allocFailures;
+    u64 drops;
+};
+
+/*
+ * Per-CPU log2 latency histograms of a queue, measured from enqueue. Bucket
+ * i counts messages that took [2^i, 2^(i+1)) ns; the last bucket also takes
+ * anything slower. receive stops when a receiver takes the message and ack
+ * when msg_ack releases it.
+ */
+#define MQ_LATENCY_BUCKETS 32
+
+struct MessageLatency
+{
+    u64 receive[MQ_LATENCY_BUCKETS];
+    u64 ack[MQ_LATENCY_BUCKETS];
+};
+
+/*
+ * Each queue owns a pool of depth slots. tail, head and ackHead count the
+ * messages sent, received and acknowledged so far:
+ *   ackHead <= head <= tail, tail + reserved - ackHead <= depth
+ * reserved counts credit taken by senders that are still pinning their
+ * message without queueLock and have yet to queue it.
+ * Queued slots wait on queued[priority], one FIFO list per priority, and bit
+ * priority of prioMap is set while that list is non-empty, so the next
+ * message is found with a single __fls() however deep the queue is.
+ * Received slots move to the received list in receive order and keep their
+ * buffer until msg_ack releases them back to the free list. A message's
+ * sequence number is its position in receive order, starting at one, and
+ * msg_receive_ext reports it as ackSequence; for messages of equal priority
+ * that is also the order they were sent in.
+ * sent counts every message ever queued and numbers them for
+ * msg_receive_ext, which unlike tail never goes back when a pinned message
+ * is withdrawn.
+ *
+ * queueLock is a spinlock that only covers index and slot bookkeeping, so
+ * any number of senders and receivers can use a queue at once. Senders copy
+ * the message in before taking it and receivers claim the head slot, mark
+ * it busy and copy out after dropping it. Acks never release a busy slot;
+ * they raise ackTo and the receiver finishing the copy releases the rest.
+ * Calls that acknowledge only the messages they received themselves mark
+ * those slots acked instead of raising ackTo; such a slot is released once
+ * every slot received before it has been.
+ *
+ * window is the credit window: at most window messages (1 <= window <=
+ * depth) may be unacknowledged at once, counting both queued and received
+ * ones. A window of 1 gives the original stop-and-wait protocol where every
+ * send waits for the previous message's ack.
+ *
+ * A nonblock queue never sleeps in msg_send or msg_receive; calls that would
+ * have to wait fail with -EAGAIN instead.
+ *
+ * parked lists the receivers waiting for a direct handoff, oldest first. A
+ * handed-off message is sent from its sender's pinned pages and is queued
+ * and claimed for its receiver in one queueLock hold, so sequence numbers,
+ * acks and the window work as for any other message.
+ *
+ * set, setNode and readyNode are the queue's membership in a struct
+ * QueueSet and are changed with both queueLock and the set's lock held.
+ *
+ * stats holds the queue's per-CPU counters and peakDepth the most messages
+ * it has held at once (for sharded queues, the most one shard has held).
+ * Both are freed an RCU grace period after the queue, so /proc readers
+ * walking the registry can still use them. latency is only allocated once
+ * histograms are switched on with MQ_CTL_SET_LATENCY, as it costs a
+ * timestamp per receive and ack; it then lives as long as stats.
+ *
+ * lockStats is the queue's lock contention profile, filled in only while
+ * the profiler is on.
+ *
+ * Sharded queues use shards instead of slots and never take queueLock on
+ * the message path. Messages are acknowledged as they are received, so the
+ * window does not apply. Receivers take from their own CPU's shard first,
+ * or, for ordered queues, from the shard whose oldest message was enqueued
+ * first.
+ */
+typedef struct
+{
+    unsigned int id;
+    unsigned int depth;
+    unsigned int window;
+    unsigned long head;
+    unsigned long tail;
+    unsigned long ackHead;
+    unsigned long ackTo;
+    unsigned long sent;
+    unsigned long reserved;
+    MessageSlot * slots;
+    unsigned long prioMap;
+    struct list_head queued[MQ_PRIO_MAX];
+    struct list_head received;
+    struct list_head free;
+    struct list_head parked;
+    struct MessageShard * shards;
+    unsigned int shardCount;
+    bool ordered;
+    mempool_t * pool;
+    struct MessageRingHeader * ring;
+    size_t ringSize;
+    refcount_t refs;
+    bool dead;
+    bool nonblock;
+    struct rcu_head rcu;
+    wait_queue_head_t receiveWait;
+    wait_queue_head_t sendWait;
+    atomic_t receiveSleepers;
+    atomic_t sendSleepers;
+    spinlock_t queueLock;
+    struct mutex ringLock;
+    struct QueueSet * set;
+    struct list_head setNode;
+    struct list_head readyNode;
+    struct MessageQueueStats __percpu * stats;
+    unsigned long peakDepth;
+    struct MessageLatency __percpu * latency;
+    bool latencyOn;
+    struct MessageLockStats lockStats[MQ_LOCK_SET];
+}MessageQueue;
+
+static DEFINE_PER_CPU(struct MessageQueueStats, mqGlobalStats);
+
+#define MQ_STAT_ADD(mqPtr, field, value) \
+    do { \
+        this_cpu_add((mqPtr)->stats->field, (value)); \
+        this_cpu_add(mqGlobalStats.field, (value)); \
+    } while (0)
+
+#define MQ_STAT_SUB(mqPtr, field, value) \
+    do { \
+        this_cpu_sub((mqPtr)->stats->field, (value)); \
+        this_cpu_sub(mqGlobalStats.field, (value)); \
+    } while (0)
+
+static void SumStats(struct MessageQueueStats __percpu * stats, struct MessageQueueStats * sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_possible_cpu(cpu)
+    {
+        struct MessageQueueStats * counters = per_cpu_ptr(stats, cpu);
+
+        sum->sends += READ_ONCE(counters->sends);
+        sum->receives += READ_ONCE(counters->receives);
+        sum->acks += READ_ONCE(counters->acks);
+        sum->sendBytes += READ_ONCE(counters->sendBytes);
+        sum->receiveBytes += READ_ONCE(counters->receiveBytes);
+        sum->sendBlocks += READ_ONCE(counters->sendBlocks);
+        sum->receiveBlocks += READ_ONCE(counters->receiveBlocks);
+        sum->allocFailures += READ_ONCE(counters->allocFailures);
+        sum->drops += READ_ONCE(counters->drops);
+    }
+}
+
+/* Counters are summed while others update them, so the difference may briefly dip below zero. */
+static inline u64 StatsDepth(struct MessageQueueStats * sum)
+{
+    u64 gone = sum->receives + sum->drops;
+
+    return (sum->sends > gone) ? (sum->sends - gone) : 0u;
+}
+
+/* Returns the queue's histograms if they are being recorded, else NULL. */
+static inline struct MessageLatency __percpu * LatencyOf(MessageQueue * mqPtr)
+{
+    /* Pairs with the release in msg_queue_ctl. */
+    return smp_load_acquire(&mqPtr->latencyOn) ? mqPtr->latency : NULL;
+}
+
+static inline unsigned int LatencyBucket(u64 ns)
+{
+    return (0u == ns) ? 0u : min_t(unsigned int, ilog2(ns), MQ_LATENCY_BUCKETS - 1);
+}
+
+static inline void NoteReceiveLatency(MessageQueue * mqPtr, u64 enqueueTime)
+{
+    struct MessageLatency __percpu * latency = LatencyOf(mqPtr);
+
+    if (latency != NULL)
+    {
+        this_cpu_inc(latency->receive[LatencyBucket(ktime_get_ns() - enqueueTime)]);
+    }
+}
+
+static inline void FillMessageInfo(struct MessageInfo * info, MessageSlot * slot, unsigned int shard)
+{
+    if (info != NULL)
+    {
+        info->enqueueTime = slot->enqueueTime;
+        info->sequence = slot->sequence;
+        info->ackSequence = slot->ackSequence;
+        info->length = slot->len;
+        info->priority = slot->priority;
+        info->tgid = slot->tgid;
+        info->shard = shard;
+    }
+}
+
+/* Racy by design: the peak only has to be close, not exact. */
+static inline void NotePeakDepth(MessageQueue * mqPtr, unsigned long depth)
+{
+    if (depth > READ_ONCE(mqPtr->peakDepth))
+    {
+        WRITE_ONCE(mqPtr->peakDepth, depth);
+    }
+}
+
+/*
+ * A queue set, modelled on Mach port sets, lets one receiver wait on many
+ * queues. Members with messages pending sit on the ready list, so
+ * msg_receive_any finds one in O(1) however many members the set has. A
+ * queue belongs to at most one set; the set holds a reference on each member
+ * and each member holds one on the set. Lock order is the member's queueLock,
+ * then the set's lock.
+ */
+struct QueueSet
+{
+    struct rhash_head node;
+    unsigned int id;
+    spinlock_t lock;
+    struct list_head ready;
+    struct list_head members;
+    wait_queue_head_t wait;
+    refcount_t refs;
+    bool dead;
+    struct rcu_head rcu;
+};
+
+/*
+ * Queues are indexed by queueId in a resizable hash table so lookup stays
+ * O(1) however many queues exist. The table is read under RCU only; writers
+ * rely on the table's own bucket locks, so no global lock is taken on any
+ * path.
+ */
+struct QueueList{
+     struct rhash_head node;
+     unsigned int queueId;
+     MessageQueue * mqPtr;
+     struct rcu_head rcu;
+};
+
+static const struct rhashtable_params queueRegistryParams = {
+    .key_len = sizeof(unsigned int),
+    .key_offset = offsetof(struct QueueList, queueId),
+    .head_offset = offsetof(struct QueueList, node),
+    .automatic_shrinking = true,
+};
+
+static struct rhashtable queueRegistry;
+
+static const struct rhashtable_params setRegistryParams = {
+    .key_len = sizeof(unsigned int),
+    .key_offset = offsetof(struct QueueSet, id),
+    .head_offset = offsetof(struct QueueSet, node),
+    .automatic_shrinking = true,
+};
+
+static struct rhashtable setRegistry;
+
+static const unsigned int messageClassSize[MESSAGE_CLASSES] = {64u, 128u, MESSAGE_MAX};
+static const char * const messageClassName[MESSAGE_CLASSES] = {"msgqueue_buf_64", "msgqueue_buf_128", "msgqueue_buf_256"};
+
+static struct kmem_cache * messageCache[MESSAGE_CLASSES];
+static struct kmem_cache * queueCache;
+static struct kmem_cache * queueListCache;
+
+int AddMessageQueue(unsigned int queueId, MessageQueue * mqPtr);
+MessageQueue * RemoveMessageQueue(unsigned int queueId);
+MessageQueue * GetMessageQueue(unsigned int queueId);
+void PutMessageQueue(MessageQueue * mqPtr);
+
+int AddMessageQueue(unsigned int queueId, MessageQueue * mqPtr)
+{
+    int status = -ENOMEM;
+    struct QueueList *np = kmem_cache_alloc(queueListCache, GFP_KERNEL);
+
+    if (np != NULL)
+    {
+        np->queueId = queueId;
+        np->mqPtr = mqPtr;
+
+        status = rhashtable_lookup_insert_fast(&queueRegistry, &np->node, queueRegistryParams);
+        if (0 != status)
+        {
+            kmem_cache_free(queueListCache, np);
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Unpublishes queueId and hands the registry's reference to the caller.
+ * Returns NULL if the queue does not exist or another delete won the race.
+ */
+MessageQueue * RemoveMessageQueue(unsigned int queueId)
+{
+    struct QueueList *np;
+    MessageQueue * mqPtr = NULL;
+
+    rcu_read_lock();
+
+    np = rhashtable_lookup(&queueRegistry, &queueId, queueRegistryParams);
+    if ((np != NULL) && (0 == rhashtable_remove_fast(&queueRegistry, &np->node, queueRegistryParams)))
+    {
+        mqPtr = np->mqPtr;
+        kfree_rcu(np, rcu);
+    }
+
+    rcu_read_unlock();
+
+    return mqPtr;
+}
+
+/*
+ * Looks up queueId without taking any lock and returns the queue with a
+ * reference held, or NULL. Every successful call must be paired with
+ * PutMessageQueue().
+ */
+MessageQueue * GetMessageQueue(unsigned int queueId)
+{
+    struct QueueList *np;
+    MessageQueue * mqPtr = NULL;
+
+    rcu_read_lock();
+
+    np = rhashtable_lookup(&queueRegistry, &queueId, queueRegistryParams);
+    if ((np != NULL) && refcount_inc_not_zero(&np->mqPtr->refs))
+    {
+        mqPtr = np->mqPtr;
+    }
+
+    rcu_read_unlock();
+
+    return mqPtr;
+}
+
+static inline int MessageClass(unsigned int length)
+{
+    int class;
+
+    for (class = 0; class < MESSAGE_CLASSES; class++)
+    {
+        if (length <= messageClassSize[class])
+        {
+            return class;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Messages up to MESSAGE_MAX come from the queue's preallocated pool if it
+ * has one, else from the matching size-class cache. Only oversized messages,
+ * which SendMessage() has already bounded by MESSAGE_SIZE_MAX, fall back to
+ * a general-purpose allocation. Buffers are charged to the sender's memory
+ * cgroup, as they can stay queued long after the send returns.
+ */
+static char * AllocMessageBuffer(MessageQueue * mqPtr, unsigned int length)
+{
+    int class = MessageClass(length);
+    char * buffer;
+
+    if ((class >= 0) && (mqPtr->pool != NULL))
+    {
+        buffer = mempool_alloc(mqPtr->pool, GFP_KERNEL);
+    }
+    else if (class >= 0)
+    {
+        buffer = kmem_cache_alloc(messageCache[class], GFP_KERNEL_ACCOUNT);
+    }
+    else
+    {
+        buffer = kvmalloc(length, GFP_KERNEL_ACCOUNT);
+    }
+
+    if (buffer == NULL)
+    {
+        MQ_STAT_ADD(mqPtr, allocFailures, 1u);
+    }
+
+    return buffer;
+}
+
+static void FreeMessageBuffer(MessageQueue * mqPtr, char * buffer, unsigned int length)
+{
+    int class = MessageClass(length);
+
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    if ((class >= 0) && (mqPtr->pool != NULL))
+    {
+        mempool_free(buffer, mqPtr->pool);
+    }
+    else if (class >= 0)
+    {
+        kmem_cache_free(messageCache[class], buffer);
+    }
+    else if (is_vmalloc_addr(buffer))
+    {
+        /* Buffers are released under queueLock, where vfree may not sleep. */
+        vfree_atomic(buffer);
+    }
+    else
+    {
+        kfree(buffer);
+    }
+}
+
+static void FreeMessageStorage(MessageQueue * mqPtr)
+{
+    unsigned int shard;
+    unsigned long index;
+
+    if (mqPtr->slots != NULL)
+    {
+        LOG("Deleting message buffers.");
+        for (index = 0u; index < mqPtr->depth; index++)
+        {
+            MessageSlot * slot = &mqPtr->slots[index];
+
+            FreeMessageBuffer(mqPtr, slot->buffer, slot->len);
+        }
+    }
+
+    if (mqPtr->shards != NULL)
+    {
+        for (shard = 0u; shard < mqPtr->shardCount; shard++)
+        {
+            struct MessageShard * shardPtr = &mqPtr->shards[shard];
+
+            if (shardPtr->slots == NULL)
+            {
+                continue;
+            }
+
+            for (index = shardPtr->head; index != shardPtr->tail; index++)
+            {
+                MessageSlot * slot = &shardPtr->slots[index % mqPtr->depth];
+
+                FreeMessageBuffer(mqPtr, slot->buffer, slot->len);
+            }
+            kvfree(shardPtr->slots);
+        }
+        kvfree(mqPtr->shards);
+        mqPtr->shards = NULL;
+    }
+
+    if (mqPtr->pool != NULL)
+    {
+        mempool_destroy(mqPtr->pool);
+        mqPtr->pool = NULL;
+    }
+
+    kvfree(mqPtr->slots);
+    mqPtr->slots = NULL;
+    vfree(mqPtr->ring);
+    mqPtr->ring = NULL;
+}
+
+/*
+ * Allocates the in-kernel slot ring or per-CPU shards (and the buffer pool),
+ * or, for MQ_FLAG_SHARED queues, the user-mappable ring region.
+ */
+static bool AllocMessageStorage(MessageQueue * mqPtr, unsigned int depth, unsigned int flags)
+{
+    unsigned int shard;
+    unsigned int index;
+
+    if (0u != (flags & MQ_FLAG_SHARED))
+    {
+        LOG("Creating shared message ring.");
+        mqPtr->ringSize = PAGE_SIZE + ((size_t)depth * MQ_RING_SLOT_SIZE);
+        mqPtr->ring = vmalloc_user(mqPtr->ringSize);
+        if (mqPtr->ring == NULL)
+        {
+            return false;
+        }
+
+        mqPtr->ring->magic = MQ_RING_MAGIC;
+        mqPtr->ring->slotSize = MQ_RING_SLOT_SIZE;
+        mqPtr->ring->slotCount = depth;
+        mqPtr->ring->dataOffset = PAGE_SIZE;
+
+        return true;
+    }
+
+    if (0u != (flags & MQ_FLAG_SHARDED))
+    {
+        LOG("Creating per-CPU message shards.");
+        mqPtr->shardCount = nr_cpu_ids;
+        mqPtr->shards = kvcalloc(mqPtr->shardCount, sizeof(struct MessageShard), GFP_KERNEL);
+        if (mqPtr->shards == NULL)
+        {
+            return false;
+        }
+
+        for (shard = 0u; shard < mqPtr->shardCount; shard++)
+        {
+            spin_lock_init(&mqPtr->shards[shard].lock);
+            /* A deep shard is too large for a reliable kmalloc, so fall back to vmalloc. */
+            mqPtr->shards[shard].slots = kvzalloc_node(array_size(depth, sizeof(MessageSlot)), GFP_KERNEL, cpu_to_node(shard));
+            if (mqPtr->shards[shard].slots == NULL)
+            {
+                FreeMessageStorage(mqPtr);
+                return false;
+            }
+        }
+    }
+    else
+    {
+        mqPtr->slots = (MessageSlot*)kvcalloc(depth, sizeof(MessageSlot), GFP_KERNEL);
+        if (mqPtr->slots == NULL)
+        {
+            return false;
+        }
+
+        for (index = 0u; index < MQ_PRIO_MAX; index++)
+        {
+            INIT_LIST_HEAD(&mqPtr->queued[index]);
+        }
+        INIT_LIST_HEAD(&mqPtr->received);
+        INIT_LIST_HEAD(&mqPtr->free);
+        INIT_LIST_HEAD(&mqPtr->parked);
+
+        for (index = 0u; index < depth; index++)
+        {
+            list_add_tail(&mqPtr->slots[index].node, &mqPtr->free);
+        }
+    }
+
+    if (0u != (flags & MQ_FLAG_PREALLOC))
+    {
+        LOG("Preallocating message buffers.");
+        mqPtr->pool = mempool_create_slab_pool(depth, messageCache[MESSAGE_CLASSES - 1]);
+        if (mqPtr->pool == NULL)
+        {
+            FreeMessageStorage(mqPtr);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void FreeMessageQueueRcu(struct rcu_head * rcu)
+{
+    MessageQueue * mqPtr = container_of(rcu, MessageQueue, rcu);
+
+    free_percpu(mqPtr->latency);
+    free_percpu(mqPtr->stats);
+    kmem_cache_free(queueCache, mqPtr);
+}
+
+static void FreeMessageQueue(MessageQueue * mqPtr)
+{
+    struct MessageQueueStats sum;
+
+    /* Nobody else holds a reference, so the sum is exact; take what is left off the global depth. */
+    SumStats(mqPtr->stats, &sum);
+    MQ_STAT_ADD(mqPtr, drops, StatsDepth(&sum));
+
+    FreeMessageStorage(mqPtr);
+
+    /* Lookups that raced with delete may still be reading refs, and /proc readers the stats. */
+    LOG("Deleting queue.");
+    call_rcu(&mqPtr->rcu, FreeMessageQueueRcu);
+}
+
+void PutMessageQueue(MessageQueue * mqPtr)
+{
+    if (refcount_dec_and_test(&mqPtr->refs))
+    {
+        FreeMessageQueue(mqPtr);
+    }
+}
+
+/*
+ * Lock wrappers. With the profiler off they are the plain lock calls behind
+ * a static branch. With it on, an uncontended acquisition costs a trylock
+ * and a few counter updates, and a contended one is also timed from the
+ * failed trylock until the lock is held. stats is NULL for set locks.
+ */
+static void NoteLock(struct MessageLockStats * stats, unsigned int class, bool contended, u64 waitNs)
+{
+    this_cpu_inc(mqLockTotals[class].acquisitions);
+    if (stats != NULL)
+    {
+        atomic64_inc(&stats->acquisitions);
+    }
+
+    if (!contended)
+    {
+        return;
+    }
+
+    this_cpu_inc(mqLockTotals[class].contended);
+    this_cpu_add(mqLockTotals[class].waitNs, waitNs);
+    if (waitNs > this_cpu_read(mqLockTotals[class].maxWaitNs))
+    {
+        this_cpu_write(mqLockTotals[class].maxWaitNs, waitNs);
+    }
+
+    if (stats != NULL)
+    {
+        atomic64_inc(&stats->contended);
+        atomic64_add(waitNs, &stats->waitNs);
+        if (waitNs > READ_ONCE(stats->maxWaitNs))
+        {
+            WRITE_ONCE(stats->maxWaitNs, waitNs);
+        }
+    }
+}
+
+static noinline void LockSpinProfiled(spinlock_t * lock, struct MessageLockStats * stats, unsigned int class)
+{
+    u64 start;
+
+    if (spin_trylock(lock))
+    {
+        NoteLock(stats, class, false, 0u);
+        return;
+    }
+
+    start = ktime_get_ns();
+    spin_lock(lock);
+    NoteLock(stats, class, true, ktime_get_ns() - start);
+}
+
+static noinline void LockMutexProfiled(struct mutex * lock, struct MessageLockStats * stats, unsigned int class)
+{
+    u64 start;
+
+    if (mutex_trylock(lock))
+    {
+        NoteLock(stats, class, false, 0u);
+        return;
+    }
+
+    start = ktime_get_ns();
+    mutex_lock(lock);
+    NoteLock(stats, class, true, ktime_get_ns() - start);
+}
+
+static inline void LockQueue(MessageQueue * mqPtr)
+{
+    if (static_branch_unlikely(&mqLockStatKey))
+    {
+        LockSpinProfiled(&mqPtr->queueLock, &mqPtr->lockStats[MQ_LOCK_QUEUE], MQ_LOCK_QUEUE);
+    }
+    else
+    {
+        spin_lock(&mqPtr->queueLock);
+    }
+}
+
+static inline void LockRing(MessageQueue * mqPtr)
+{
+    if (static_branch_unlikely(&mqLockStatKey))
+    {
+        LockMutexProfiled(&mqPtr->ringLock, &mqPtr->lockStats[MQ_LOCK_RING], MQ_LOCK_RING);
+    }
+    else
+    {
+        mutex_lock(&mqPtr->ringLock);
+    }
+}
+
+static inline void LockShard(MessageQueue * mqPtr, struct MessageShard * shard)
+{
+    if (static_branch_unlikely(&mqLockStatKey))
+    {
+        LockSpinProfiled(&shard->lock, &mqPtr->lockStats[MQ_LOCK_SHARD], MQ_LOCK_SHARD);
+    }
+    else
+    {
+        spin_lock(&shard->lock);
+    }
+}
+
+static inline void LockSet(struct QueueSet * set)
+{
+    if (static_branch_unlikely(&mqLockStatKey))
+    {
+        LockSpinProfiled(&set->lock, NULL, MQ_LOCK_SET);
+    }
+    else
+    {
+        spin_lock(&set->lock);
+    }
+}
+
+/* Returns the set with a reference held, or NULL. Pair with PutQueueSet(). */
+static struct QueueSet * GetQueueSet(unsigned int setId)
+{
+    struct QueueSet * set;
+
+    rcu_read_lock();
+
+    set = rhashtable_lookup(&setRegistry, &setId, setRegistryParams);
+    if ((set != NULL) && !refcount_inc_not_zero(&set->refs))
+    {
+        set = NULL;
+    }
+
+    rcu_read_unlock();
+
+    return set;
+}
+
+static void PutQueueSet(struct QueueSet * set)
+{
+    if (refcount_dec_and_test(&set->refs))
+    {
+        kfree_rcu(set, rcu);
+    }
+}
+
+/*
+ * Puts mqPtr on its set's ready list, if it is in a set and not already
+ * there, and wakes one msg_receive_any caller. Called with queueLock held.
+ */
+static void MarkReady(MessageQueue * mqPtr)
+{
+    struct QueueSet * set = mqPtr->set;
+    bool added = false;
+
+    if (set == NULL)
+    {
+        return;
+    }
+
+    LockSet(set);
+    if (list_empty(&mqPtr->readyNode))
+    {
+        list_add_tail(&mqPtr->readyNode, &set->ready);
+        added = true;
+    }
+    spin_unlock(&set->lock);
+
+    if (added)
+    {
+        wake_up_interruptible(&set->wait);
+    }
+}
+
+/* Removes mqPtr from set. Called with queueLock held. */
+static void DetachFromSet(MessageQueue * mqPtr, struct QueueSet * set)
+{
+    if (mqPtr->set != set)
+    {
+        return;
+    }
+
+    LockSet(set);
+    list_del_init(&mqPtr->readyNode);
+    list_del_init(&mqPtr->setNode);
+    spin_unlock(&set->lock);
+
+    mqPtr->set = NULL;
+
+    /* The caller holds its own reference, so neither of these frees mqPtr. */
+    PutMessageQueue(mqPtr);
+    PutQueueSet(set);
+}
+
+/* /proc/messagequeue/stats: totals over every queue since boot. */
+static int GlobalStatsShow(struct seq_file * m, void * v)
+{
+    struct MessageQueueStats sum;
+
+    SumStats(&mqGlobalStats, &sum);
+
+    seq_printf(m, "sends %llu\n", sum.sends);
+    seq_printf(m, "receives %llu\n", sum.receives);
+    seq_printf(m, "acks %llu\n", sum.acks);
+    seq_printf(m, "send_bytes %llu\n", sum.sendBytes);
+    seq_printf(m, "receive_bytes %llu\n", sum.receiveBytes);
+    seq_printf(m, "send_blocks %llu\n", sum.sendBlocks);
+    seq_printf(m, "receive_blocks %llu\n", sum.receiveBlocks);
+    seq_printf(m, "alloc_failures %llu\n", sum.allocFailures);
+    seq_printf(m, "drops %llu\n", sum.drops);
+    seq_printf(m, "depth %llu\n", StatsDepth(&sum));
+
+    return 0;
+}
+
+/*
+ * /proc/messagequeue/queues: one line per live queue, keyed by queue id.
+ * The registry is walked under RCU, which also keeps every queue seen and
+ * its counters from being freed until the line is printed.
+ *
+ * The walk is entered once per open file and only started and stopped
+ * around each read, so a read resumes where the last one stopped instead of
+ * skipping *pos entries from the start. pos is the position of the entry
+ * the walk is on, the one rhashtable_walk_peek() returns.
+ */
+struct QueueStatsIter
+{
+    struct rhashtable_iter iter;
+    loff_t pos;
+};
+
+static struct QueueList * QueueStatsWalk(struct rhashtable_iter * iter)
+{
+    struct QueueList * np;
+
+    do
+    {
+        np = rhashtable_walk_next(iter);
+    } while (PTR_ERR(np) == -EAGAIN);
+
+    return IS_ERR(np) ? NULL : np;
+}
+
+static void * QueueStatsStart(struct seq_file * m, loff_t * pos)
+{
+    struct QueueStatsIter * it = m->private;
+    struct QueueList * np;
+
+    if (*pos < it->pos)
+    {
+        /* Reading again from an earlier offset: walk from the beginning. */
+        rhashtable_walk_exit(&it->iter);
+        rhashtable_walk_enter(&queueRegistry, &it->iter);
+        it->pos = 0;
+    }
+
+    rhashtable_walk_start(&it->iter);
+
+    if (0 == *pos)
+    {
+        return SEQ_START_TOKEN;
+    }
+
+    if (*pos == it->pos)
+    {
+        /* The entry the last read stopped at was fetched but not shown. */
+        np = rhashtable_walk_peek(&it->iter);
+        if (PTR_ERR(np) == -EAGAIN)
+        {
+            np = QueueStatsWalk(&it->iter);
+        }
+        return IS_ERR(np) ? NULL : np;
+    }
+
+    for (np = NULL; it->pos < *pos; it->pos++)
+    {
+        np = QueueStatsWalk(&it->iter);
+        if (np == NULL)
+        {
+            break;
+        }
+    }
+
+    return np;
+}
+
+static void * QueueStatsNext(struct seq_file * m, void * v, loff_t * pos)
+{
+    struct QueueStatsIter * it = m->private;
+
+    ++*pos;
+    it->pos = *pos;
+
+    return QueueStatsWalk(&it->iter);
+}
+
+static void QueueStatsStop(struct seq_file * m, void * v)
+{
+    struct QueueStatsIter * it = m->private;
+
+    rhashtable_walk_stop(&it->iter);
+}
+
+/* The three registry files share one proc_ops; their seq_operations come from the proc entry. */
+static int QueueStatsOpen(struct inode * inode, struct file * file)
+{
+    struct QueueStatsIter * it = __seq_open_private(file, pde_data(inode), sizeof(*it));
+
+    if (it == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    rhashtable_walk_enter(&queueRegistry, &it->iter);
+
+    return 0;
+}
+
+static int QueueStatsRelease(struct inode * inode, struct file * file)
+{
+    struct seq_file * m = file->private_data;
+    struct QueueStatsIter * it = m->private;
+
+    rhashtable_walk_exit(&it->iter);
+
+    return seq_release_private(inode, file);
+}
+
+static const struct proc_ops QueueStatsProcOps = {
+    .proc_open = QueueStatsOpen,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = QueueStatsRelease,
+};
+
+static int QueueStatsShow(struct seq_file * m, void * v)
+{
+    struct QueueList * np = v;
+    MessageQueue * mqPtr;
+    struct MessageQueueStats sum;
+
+    if (v == SEQ_START_TOKEN)
+    {
+        seq_puts(m, "queue sends receives acks send_bytes receive_bytes send_blocks receive_blocks "
+                    "alloc_failures depth peak_depth send_waiters receive_waiters\n");
+        return 0;
+    }
+
+    mqPtr = np->mqPtr;
+    SumStats(mqPtr->stats, &sum);
+
+    seq_printf(m, "%u %llu %llu %llu %llu %llu %llu %llu %llu %llu %lu %d %d\n",
+               mqPtr->id, sum.sends, sum.receives, sum.acks, sum.sendBytes, sum.receiveBytes,
+               sum.sendBlocks, sum.receiveBlocks, sum.allocFailures, StatsDepth(&sum),
+               READ_ONCE(mqPtr->peakDepth), atomic_read(&mqPtr->sendSleepers), atomic_read(&mqPtr->receiveSleepers));
+
+    return 0;
+}
+
+static const struct seq_operations QueueStatsOps = {
+    .start = QueueStatsStart,
+    .next = QueueStatsNext,
+    .stop = QueueStatsStop,
+    .show = QueueStatsShow,
+};
+
+static void ShowHistogram(struct seq_file * m, unsigned int queueId, const char * name,
+                          struct MessageLatency __percpu * latency, size_t offset)
+{
+    unsigned int bucket;
+    int cpu;
+
+    seq_printf(m, "%u %s", queueId, name);
+
+    for (bucket = 0u; bucket < MQ_LATENCY_BUCKETS; bucket++)
+    {
+        u64 count = 0u;
+
+        for_each_possible_cpu(cpu)
+        {
+            const u64 * buckets = (const u64 *)((const char *)per_cpu_ptr(latency, cpu) + offset);
+
+            count += READ_ONCE(buckets[bucket]);
+        }
+
+        seq_printf(m, " %llu", count);
+    }
+
+    seq_putc(m, '\n');
+}
+
+/*
+ * /proc/messagequeue/latency: a receive and an ack histogram line for every
+ * queue that records them. Walks the registry like the queues file.
+ */
+static int LatencyShow(struct seq_file * m, void * v)
+{
+    struct QueueList * np = v;
+    struct MessageLatency __percpu * latency;
+
+    if (v == SEQ_START_TOKEN)
+    {
+        seq_printf(m, "# queue histogram, then %u counts; count i is messages that took [2^i, 2^(i+1)) ns\n",
+                   MQ_LATENCY_BUCKETS);
+        return 0;
+    }
+
+    latency = READ_ONCE(np->mqPtr->latency);
+    if (latency != NULL)
+    {
+        ShowHistogram(m, np->mqPtr->id, "receive", latency, offsetof(struct MessageLatency, receive));
+        ShowHistogram(m, np->mqPtr->id, "ack", latency, offsetof(struct MessageLatency, ack));
+    }
+
+    return 0;
+}
+
+static const struct seq_operations LatencyOps = {
+    .start = QueueStatsStart,
+    .next = QueueStatsNext,
+    .stop = QueueStatsStop,
+    .show = LatencyShow,
+};
+
+/*
+ * /proc/messagequeue/locks: the lock contention profile, first the totals
+ * per lock class, then one line per queue and class that was profiled.
+ */
+static int LockStatsShow(struct seq_file * m, void * v)
+{
+    struct QueueList * np = v;
+    unsigned int class;
+    int cpu;
+
+    if (v == SEQ_START_TOKEN)
+    {
+        seq_puts(m, "queue class acquisitions contended wait_ns max_wait_ns\n");
+
+        for (class = 0u; class < MQ_LOCK_CLASSES; class++)
+        {
+            struct MessageLockTotals sum = {0};
+
+            for_each_possible_cpu(cpu)
+            {
+                struct MessageLockTotals * totals = per_cpu_ptr(&mqLockTotals[class], cpu);
+
+                sum.acquisitions += READ_ONCE(totals->acquisitions);
+                sum.contended += READ_ONCE(totals->contended);
+                sum.waitNs += READ_ONCE(totals->waitNs);
+                sum.maxWaitNs = max(sum.maxWaitNs, READ_ONCE(totals->maxWaitNs));
+            }
+
+            seq_printf(m, "all %s %llu %llu %llu %llu\n", lockClassName[class],
+                       sum.acquisitions, sum.contended, sum.waitNs, sum.maxWaitNs);
+        }
+        return 0;
+    }
+
+    for (class = 0u; class < MQ_LOCK_SET; class++)
+    {
+        struct MessageLockStats * stats = &np->mqPtr->lockStats[class];
+        s64 acquisitions = atomic64_read(&stats->acquisitions);
+
+        if (0 != acquisitions)
+        {
+            seq_printf(m, "%u %s %lld %lld %lld %llu\n", np->mqPtr->id, lockClassName[class], acquisitions,
+                       atomic64_read(&stats->contended), atomic64_read(&stats->waitNs), READ_ONCE(stats->maxWaitNs));
+        }
+    }
+
+    return 0;
+}
+
+static const struct seq_operations LockStatsOps = {
+    .start = QueueStatsStart,
+    .next = QueueStatsNext,
+    .stop = QueueStatsStop,
+    .show = LockStatsShow,
+};
+
+static int __init MessageQueueInit(void)
+{
+    struct proc_dir_entry * dir;
+    int class;
+    int ret;
+
+    queueCache = kmem_cache_create("msgqueue", sizeof(MessageQueue), 0, SLAB_HWCACHE_ALIGN | SLAB_PANIC, NULL);
+    queueListCache = kmem_cache_create("msgqueue_list", sizeof(struct QueueList), 0, SLAB_PANIC, NULL);
+
+    for (class = 0; class < MESSAGE_CLASSES; class++)
+    {
+        messageCache[class] = kmem_cache_create(messageClassName[class], messageClassSize[class], 0, SLAB_PANIC, NULL);
+    }
+
+    ret = rhashtable_init(&setRegistry, &setRegistryParams);
+    if (0 == ret)
+    {
+        ret = rhashtable_init(&queueRegistry, &queueRegistryParams);
+    }
+
+    /* Statistics are optional; the queues work without them. */
+    dir = proc_mkdir("messagequeue", NULL);
+    if (dir != NULL)
+    {
+        proc_create_single("stats", 0444, dir, GlobalStatsShow);
+        proc_create_data("queues", 0444, dir, &QueueStatsProcOps, (void *)&QueueStatsOps);
+        proc_create_data("latency", 0444, dir, &QueueStatsProcOps, (void *)&LatencyOps);
+        proc_create_data("locks", 0444, dir, &QueueStatsProcOps, (void *)&LockStatsOps);
+    }
+
+    return ret;
+}
+subsys_initcall(MessageQueueInit);
+
+static inline bool WindowFull(MessageQueue * mqPtr)
+{
+    return (READ_ONCE(mqPtr->tail) + READ_ONCE(mqPtr->reserved) - READ_ONCE(mqPtr->ackHead)) >= READ_ONCE(mqPtr->window);
+}
+
+static inline bool RingEmpty(MessageQueue * mqPtr)
+{
+    return READ_ONCE(mqPtr->head) == READ_ONCE(mqPtr->tail);
+}
+
+static inline bool ShardFull(MessageQueue * mqPtr, struct MessageShard * shard)
+{
+    return (READ_ONCE(shard->tail) - READ_ONCE(shard->head)) >= mqPtr->depth;
+}
+
+static bool ShardsFull(MessageQueue * mqPtr)
+{
+    unsigned int shard;
+
+    for (shard = 0u; shard < mqPtr->shardCount; shard++)
+    {
+        if (!ShardFull(mqPtr, &mqPtr->shards[shard]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool ShardsEmpty(MessageQueue * mqPtr)
+{
+    unsigned int shard;
+
+    for (shard = 0u; shard < mqPtr->shardCount; shard++)
+    {
+        if (READ_ONCE(mqPtr->shards[shard].head) != smp_load_acquire(&mqPtr->shards[shard].tail))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Blocking engine. Senders sleep on sendWait until they have credit and
+ * receivers on receiveWait until a message is queued. Both sleep
+ * interruptibly and exclusively, and every event wakes only as many tasks as
+ * it can satisfy: one receiver per queued message and one sender per
+ * released credit, so a hot queue with many idle consumers does not stampede.
+ * A task that is woken but gives up (signal or deadline) hands its wakeup on
+ * if the event is still pending. Deleting the queue wakes everyone.
+ *
+ * Sleeps take an optional absolute CLOCK_REALTIME deadline, as mq_timedsend
+ * does, and are then bounded by an hrtimer. A zero deadline, like a nonblock
+ * queue, means the caller must not sleep at all.
+ */
+static inline void WakeReceivers(MessageQueue * mqPtr, unsigned int nr)
+{
+    if ((0u != nr) && wq_has_sleeper(&mqPtr->receiveWait))
+    {
+        LOG("Waking receivers.");
+        wake_up_interruptible_nr(&mqPtr->receiveWait, nr);
+    }
+}
+
+static inline void WakeSenders(MessageQueue * mqPtr, unsigned int nr)
+{
+    if ((0u != nr) && wq_has_sleeper(&mqPtr->sendWait))
+    {
+        LOG("Waking senders.");
+        wake_up_interruptible_nr(&mqPtr->sendWait, nr);
+    }
+}
+
+/*
+ * Tasks asleep on a queue, for /proc/messagequeue/queues. poll and epoll
+ * entries on the same wait queues are not counted.
+ */
+static inline atomic_t * Sleepers(MessageQueue * mqPtr, wait_queue_head_t * wq)
+{
+    return (wq == &mqPtr->sendWait) ? &mqPtr->sendSleepers : &mqPtr->receiveSleepers;
+}
+
+static inline void CountBlock(MessageQueue * mqPtr, wait_queue_head_t * wq)
+{
+    if (wq == &mqPtr->sendWait)
+    {
+        MQ_STAT_ADD(mqPtr, sendBlocks, 1u);
+    }
+    else
+    {
+        MQ_STAT_ADD(mqPtr, receiveBlocks, 1u);
+    }
+}
+
+static inline bool MustNotBlock(MessageQueue * mqPtr, ktime_t * deadline)
+{
+    return READ_ONCE(mqPtr->nonblock) || ((deadline != NULL) && (0 == *deadline));
+}
+
+/* Returns -ETIMEDOUT once deadline has passed, 0 if woken before it. */
+static int ScheduleUntil(ktime_t * deadline)
+{
+    if (deadline == NULL)
+    {
+        schedule();
+        return 0;
+    }
+
+    if (0 == schedule_hrtimeout_range_clock(deadline, current->timer_slack_ns, HRTIMER_MODE_ABS, CLOCK_REALTIME))
+    {
+        return -ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/*
+ * Sleeps exclusively on wq until blocked() turns false or the queue is
+ * deleted. Returns 0, -ERESTARTSYS on a signal or -ETIMEDOUT.
+ */
+static int SleepOnQueue(MessageQueue * mqPtr, wait_queue_head_t * wq, bool (*blocked)(MessageQueue *), ktime_t * deadline)
+{
+    DEFINE_WAIT(wait);
+    int ret = 0;
+
+    CountBlock(mqPtr, wq);
+    atomic_inc(Sleepers(mqPtr, wq));
+
+    for (;;)
+    {
+        prepare_to_wait_exclusive(wq, &wait, TASK_INTERRUPTIBLE);
+
+        if (!blocked(mqPtr) || READ_ONCE(mqPtr->dead))
+        {
+            break;
+        }
+
+        if (signal_pending(current))
+        {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        ret = ScheduleUntil(deadline);
+        if (0 != ret)
+        {
+            break;
+        }
+    }
+
+    finish_wait(wq, &wait);
+    atomic_dec(Sleepers(mqPtr, wq));
+
+    return ret;
+}
+
+/*
+ * Waits until mqPtr has send credit. Returns E_OK with queueLock held, or a
+ * negative errno with it released.
+ */
+static int WaitForCredit(MessageQueue * mqPtr, ktime_t * deadline)
+{
+    int ret;
+
+    LockQueue(mqPtr);
+
+    while (WindowFull(mqPtr) && !mqPtr->dead)
+    {
+        spin_unlock(&mqPtr->queueLock);
+
+        if (MustNotBlock(mqPtr, deadline))
+        {
+            LOG("No send credit and not allowed to block.");
+            return -EAGAIN;
+        }
+
+        LOG("Waiting for send credit.");
+        ret = SleepOnQueue(mqPtr, &mqPtr->sendWait, WindowFull, deadline);
+        if (0 != ret)
+        {
+            LOG("Gave up waiting for send credit.");
+            if (!WindowFull(mqPtr))
+            {
+                WakeSenders(mqPtr, 1u);
+            }
+            return ret;
+        }
+
+        LockQueue(mqPtr);
+    }
+
+    if (mqPtr->dead)
+    {
+        LOG("Queue was deleted.");
+        spin_unlock(&mqPtr->queueLock);
+        return -EIDRM;
+    }
+
+    return E_OK;
+}
+
+/*
+ * Waits until mqPtr has a message to receive. Returns E_OK with queueLock
+ * held, or a negative errno with it released.
+ */
+static int WaitForMessage(MessageQueue * mqPtr, ktime_t * deadline)
+{
+    int ret;
+
+    if ((mqPtr->ring != NULL) || (mqPtr->shards != NULL))
+    {
+        LOG("Batch receive is not supported on shared ring or sharded queues.");
+        return -EINVAL;
+    }
+
+    LockQueue(mqPtr);
+
+    while (RingEmpty(mqPtr) && !mqPtr->dead)
+    {
+        spin_unlock(&mqPtr->queueLock);
+
+        if (MustNotBlock(mqPtr, deadline))
+        {
+            LOG("Queue is empty and not allowed to block.");
+            return -EAGAIN;
+        }
+
+        LOG("Waiting for a message.");
+        ret = SleepOnQueue(mqPtr, &mqPtr->receiveWait, RingEmpty, deadline);
+        if (0 != ret)
+        {
+            LOG("Gave up waiting for a message.");
+            if (!RingEmpty(mqPtr))
+            {
+                WakeReceivers(mqPtr, 1u);
+            }
+            return ret;
+        }
+
+        LockQueue(mqPtr);
+    }
+
+    if (mqPtr->dead)
+    {
+        LOG("Queue was deleted.");
+        spin_unlock(&mqPtr->queueLock);
+        return -EIDRM;
+    }
+
+    return E_OK;
+}
+
+static inline struct MessageRingSlot * RingSlot(MessageQueue * mqPtr, __u32 index)
+{
+    /* Geometry comes from the queue, never from the user-writable header. */
+    return (struct MessageRingSlot *)((char *)mqPtr->ring + PAGE_SIZE + ((size_t)(index & (mqPtr->depth - 1u)) * MQ_RING_SLOT_SIZE));
+}
+
+/*
+ * Sleeps until *index no longer equals value, advertising the sleeper in
+ * *waiters so the peer knows to wake it. Returns 0, -ERESTARTSYS or
+ * -ETIMEDOUT.
+ */
+static int WaitOnRingIndex(MessageQueue * mqPtr, wait_queue_head_t * wq, __u32 * index, __u32 * waiters, __u32 value, ktime_t * deadline)
+{
+    DEFINE_WAIT(wait);
+    int ret = 0;
+
+    CountBlock(mqPtr, wq);
+    atomic_inc(Sleepers(mqPtr, wq));
+
+    atomic_inc((atomic_t *)waiters);
+    smp_mb__after_atomic();
+
+    for (;;)
+    {
+        prepare_to_wait(wq, &wait, TASK_INTERRUPTIBLE);
+
+        if ((READ_ONCE(*index) != value) || READ_ONCE(mqPtr->dead))
+        {
+            break;
+        }
+
+        if (signal_pending(current))
+        {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        ret = ScheduleUntil(deadline);
+        if (0 != ret)
+        {
+            break;
+        }
+    }
+
+    finish_wait(wq, &wait);
+
+    atomic_dec((atomic_t *)waiters);
+    atomic_dec(Sleepers(mqPtr, wq));
+
+    return ret;
+}
+
+/* msg_send on a shared ring: the kernel acts as the producer. */
+static int SendRingMessage(MessageQueue * mqPtr, const char __user * message, unsigned int length, ktime_t * deadline)
+{
+    struct MessageRingHeader * ring = mqPtr->ring;
+    int status = -EFAULT;
+    int ret;
+    __u32 producer;
+    __u32 consumer;
+
+    if (length > (MQ_RING_SLOT_SIZE - sizeof(struct MessageRingSlot)))
+    {
+        LOG("Message does not fit a ring slot.");
+        return -EMSGSIZE;
+    }
+
+    LockRing(mqPtr);
+
+    producer = READ_ONCE(ring->producer);
+    while ((producer - (consumer = smp_load_acquire(&ring->consumer))) >= mqPtr->depth)
+    {
+        mutex_unlock(&mqPtr->ringLock);
+
+        if (MustNotBlock(mqPtr, deadline))
+        {
+            LOG("Ring is full and not allowed to block.");
+            return -EAGAIN;
+        }
+
+        LOG("Waiting for the consumer.");
+        ret = WaitOnRingIndex(mqPtr, &mqPtr->sendWait, &ring->consumer, &ring->producerWaiters, consumer, deadline);
+        if (0 != ret)
+        {
+            return ret;
+        }
+        if (READ_ONCE(mqPtr->dead))
+        {
+            return -EIDRM;
+        }
+
+        LockRing(mqPtr);
+        producer = READ_ONCE(ring->producer);
+    }
+
+    struct MessageRingSlot * slot = RingSlot(mqPtr, producer);
+
+    LOG("Copying message from user space into the ring.");
+    if (0u != copy_from_user(slot + 1, message, length))
+    {
+        LOG("User space to kernel space copy failed.");
+    }
+    else
+    {
+        slot->length = length;
+        smp_store_release(&ring->producer, producer + 1u);
+        trace_mq_enqueue(mqPtr->id, producer + 1u, length, 0u, ktime_get_ns());
+        MQ_STAT_ADD(mqPtr, sends, 1u);
+        MQ_STAT_ADD(mqPtr, sendBytes, length);
+
+        smp_mb();
+        if ((0u != READ_ONCE(ring->consumerWaiters)) || waitqueue_active(&mqPtr->receiveWait))
+        {
+            LOG("Waking consumer.");
+            wake_up_interruptible(&mqPtr->receiveWait);
+        }
+
+        status = E_OK;
+    }
+
+    mutex_unlock(&mqPtr->ringLock);
+
+    return status;
+}
+
+/* msg_receive on a shared ring: the kernel acts as the consumer. */
+static int ReceiveRingMessage(MessageQueue * mqPtr, char __user * buffer, size_t capacity, struct MessageInfo * info, ktime_t * deadline)
+{
+    struct MessageRingHeader * ring = mqPtr->ring;
+    int status = -EFAULT;
+    int ret;
+    __u32 producer;
+    __u32 consumer;
+    __u32 len;
+
+    LockRing(mqPtr);
+
+    consumer = READ_ONCE(ring->consumer);
+    while ((producer = smp_load_acquire(&ring->producer)) == consumer)
+    {
+        mutex_unlock(&mqPtr->ringLock);
+
+        if (MustNotBlock(mqPtr, deadline))
+        {
+            LOG("Ring is empty and not allowed to block.");
+            return -EAGAIN;
+        }
+
+        LOG("Waiting for the producer.");
+        ret = WaitOnRingIndex(mqPtr, &mqPtr->receiveWait, &ring->producer, &ring->consumerWaiters, producer, deadline);
+        if (0 != ret)
+        {
+            return ret;
+        }
+        if (READ_ONCE(mqPtr->dead))
+        {
+            return -EIDRM;
+        }
+
+        LockRing(mqPtr);
+        consumer = READ_ONCE(ring->consumer);
+    }
+
+    struct MessageRingSlot * slot = RingSlot(mqPtr, consumer);
+
+    /* The length was written by a user-space producer; never trust it. */
+    len = min_t(__u32, READ_ONCE(slot->length), MQ_RING_SLOT_SIZE - sizeof(struct MessageRingSlot));
+
+    LOG("Copying message from the ring to user space.");
+    if (len > capacity)
+    {
+        LOG("Message does not fit the receive buffer.");
+        status = -EMSGSIZE;
+    }
+    else if (0u != copy_to_user(buffer, slot + 1, len))
+    {
+        LOG("Copying from kernel space to user space failed.");
+    }
+    else
+    {
+        if (info != NULL)
+        {
+            memset(info, 0, sizeof(*info));
+            info->sequence = (u64)consumer + 1u;
+            info->length = len;
+        }
+
+        smp_store_release(&ring->consumer, consumer + 1u);
+        MQ_STAT_ADD(mqPtr, receives, 1u);
+        MQ_STAT_ADD(mqPtr, receiveBytes, len);
+
+        /* Pollers are not counted in producerWaiters but must see space too. */
+        smp_mb();
+        if ((0u != READ_ONCE(ring->producerWaiters)) || waitqueue_active(&mqPtr->sendWait))
+        {
+            LOG("Waking producer.");
+            wake_up_interruptible(&mqPtr->sendWait);
+        }
+
+        status = (int)len;
+    }
+
+    mutex_unlock(&mqPtr->ringLock);
+
+    return status;
+}
+
+/*
+ * msg_send on a sharded queue. The message goes to the current CPU's shard,
+ * or the next shard with room if that one is full; only that shard's lock is
+ * taken. Blocks while every shard is full.
+ */
+static int SendShardMessage(MessageQueue * mqPtr, const char __user * message, unsigned int length, ktime_t * deadline)
+{
+    unsigned int start;
+    unsigned int index;
+    int status;
+
+    LOG("Creating message buffer.");
+    char * buffer = AllocMessageBuffer(mqPtr, length);
+    if (buffer == NULL)
+    {
+        LOG("Could not create message buffer.");
+        return -ENOMEM;
+    }
+
+    LOG("Copying message from user space to kernel space.");
+    if (0u != copy_from_user(buffer, message, length))
+    {
+        LOG("User space to kernel space copy failed.");
+        FreeMessageBuffer(mqPtr, buffer, length);
+        return -EFAULT;
+    }
+
+    for (;;)
+    {
+        if (READ_ONCE(mqPtr->dead))
+        {
+            status = -EIDRM;
+            break;
+        }
+
+        start = raw_smp_processor_id() % mqPtr->shardCount;
+        for (index = 0u; index < mqPtr->shardCount; index++)
+        {
+            struct MessageShard * shard = &mqPtr->shards[(start + index) % mqPtr->shardCount];
+
+            if (ShardFull(mqPtr, shard))
+            {
+                continue;
+            }
+
+            LockShard(mqPtr, shard);
+            if (!ShardFull(mqPtr, shard))
+            {
+                MessageSlot * slot = &shard->slots[shard->tail % mqPtr->depth];
+                unsigned long tail = shard->tail + 1u;
+                u64 enqueueTime = ktime_get_ns();
+
+                slot->buffer = buffer;
+                slot->len = length;
+                slot->enqueueTime = enqueueTime;
+                slot->sequence = tail;
+                slot->tgid = task_tgid_nr(current);
+
+                /* Pairs with the acquire in ShardsEmpty() and PickShard(). */
+                smp_store_release(&shard->tail, tail);
+                NotePeakDepth(mqPtr, tail - shard->head);
+                spin_unlock(&shard->lock);
+
+                MQ_STAT_ADD(mqPtr, sends, 1u);
+                MQ_STAT_ADD(mqPtr, sendBytes, length);
+
+                trace_mq_enqueue(mqPtr->id, tail, length, 0u, enqueueTime);
+                WakeReceivers(mqPtr, 1u);
+                return E_OK;
+            }
+            spin_unlock(&shard->lock);
+        }
+
+        if (MustNotBlock(mqPtr, deadline))
+        {
+            LOG("All shards are full and not allowed to block.");
+            status = -EAGAIN;
+            break;
+        }
+
+        LOG("Waiting for a shard with room.");
+        status = SleepOnQueue(mqPtr, &mqPtr->sendWait, ShardsFull, deadline);
+        if (0 != status)
+        {
+            if (!ShardsFull(mqPtr))
+            {
+                WakeSenders(mqPtr, 1u);
+            }
+            break;
+        }
+    }
+
+    FreeMessageBuffer(mqPtr, buffer, length);
+
+    return status;
+}
+
+/*
+ * Picks the shard to receive from: the first non-empty one starting at the
+ * current CPU's, or for ordered queues the one whose oldest message has the
+ * earliest enqueue time. Returns NULL if every shard is empty.
+ */
+static struct MessageShard * PickShard(MessageQueue * mqPtr)
+{
+    struct MessageShard * best = NULL;
+    u64 bestTime = U64_MAX;
+    unsigned int start = raw_smp_processor_id() % mqPtr->shardCount;
+    unsigned int index;
+
+    for (index = 0u; index < mqPtr->shardCount; index++)
+    {
+        struct MessageShard * shard = &mqPtr->shards[(start + index) % mqPtr->shardCount];
+        unsigned long head = READ_ONCE(shard->head);
+
+        if (head == smp_load_acquire(&shard->tail))
+        {
+            continue;
+        }
+
+        if (!mqPtr->ordered)
+        {
+            return shard;
+        }
+
+        if (READ_ONCE(shard->slots[head % mqPtr->depth].enqueueTime) < bestTime)
+        {
+            bestTime = READ_ONCE(shard->slots[head % mqPtr->depth].enqueueTime);
+            best = shard;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * msg_receive on a sharded queue. The message is taken off its shard under
+ * that shard's lock and copied out after it, and its slot is free for
+ * producers again at once.
+ */
+static int ReceiveShardMessage(MessageQueue * mqPtr, char __user * buffer, size_t capacity, struct MessageInfo * info, ktime_t * deadline)
+{
+    struct MessageShard * shard;
+    struct MessageLatency __percpu * latency;
+    MessageSlot taken;
+    unsigned long head;
+    int status;
+
+    for (;;)
+    {
+        if (READ_ONCE(mqPtr->dead))
+        {
+            return -EIDRM;
+        }
+
+        shard = PickShard(mqPtr);
+        if (shard != NULL)
+        {
+            LockShard(mqPtr, shard);
+            if (shard->head != shard->tail)
+            {
+                MessageSlot * slot = &shard->slots[shard->head % mqPtr->depth];
+
+                if (slot->len > capacity)
+                {
+                    spin_unlock(&shard->lock);
+                    LOG("Message does not fit the receive buffer.");
+                    /* The message stays queued; pass on the wakeup it may have cost. */
+                    WakeReceivers(mqPtr, 1u);
+                    return -EMSGSIZE;
+                }
+
+                taken = *slot;
+                slot->buffer = NULL;
+                head = shard->head + 1u;
+                WRITE_ONCE(shard->head, head);
+                spin_unlock(&shard->lock);
+
+                trace_mq_receive(mqPtr->id, taken.sequence, taken.len, taken.enqueueTime);
+
+                /* Sharded queues acknowledge on receive. */
+                MQ_STAT_ADD(mqPtr, receives, 1u);
+                MQ_STAT_ADD(mqPtr, receiveBytes, taken.len);
+                MQ_STAT_ADD(mqPtr, acks, 1u);
+                latency = LatencyOf(mqPtr);
+                if (latency != NULL)
+                {
+                    unsigned int bucket = LatencyBucket(ktime_get_ns() - taken.enqueueTime);
+
+                    this_cpu_inc(latency->receive[bucket]);
+                    this_cpu_inc(latency->ack[bucket]);
+                }
+                break;
+            }
+            spin_unlock(&shard->lock);
+
+            /* Another receiver beat us to it; look again. */
+            continue;
+        }
+
+        if (MustNotBlock(mqPtr, deadline))
+        {
+            LOG("All shards are empty and not allowed to block.");
+            return -EAGAIN;
+        }
+
+        LOG("Waiting for a message.");
+        status = SleepOnQueue(mqPtr, &mqPtr->receiveWait, ShardsEmpty, deadline);
+        if (0 != status)
+        {
+            if (!ShardsEmpty(mqPtr))
+            {
+                WakeReceivers(mqPtr, 1u);
+            }
+            return status;
+        }
+    }
+
+    WakeSenders(mqPtr, 1u);
+
+    LOG("Copying message from kernel space to user space.");
+    if (0u != copy_to_user(buffer, taken.buffer, taken.len))
+    {
+        LOG("Copying from kernel space to user space failed.");
+        status = -EFAULT;
+    }
+    else
+    {
+        FillMessageInfo(info, &taken, (unsigned int)(shard - mqPtr->shards));
+        status = (int)taken.len;
+    }
+
+    FreeMessageBuffer(mqPtr, taken.buffer, taken.len);
+
+    return status;
+}
+
+/* Drops a reference on a pinned message; the last one unpins the pages. Must not be called under queueLock. */
+static void PutMessagePages(struct MessagePages * pinned)
+{
+    if (refcount_dec_and_test(&pinned->refs))
+    {
+        unpin_user_pages(pinned->pages, pinned->count);
+        kvfree(pinned->pages);
+        atomic64_sub(pinned->charged, &pinned->mm->pinned_vm);
+        mmdrop(pinned->mm);
+        kfree(pinned);
+    }
+}
+
+/*
+ * Pins the pages under a message long-term for receivers to copy out of,
+ * charging them to the sender's pinned memory first. Returns the descriptor
+ * with the sender's reference, or NULL if the pages would exceed the
+ * sender's RLIMIT_MEMLOCK, an allocation failed or the memory cannot be
+ * pinned; the caller then copies the message in instead.
+ */
+static struct MessagePages * PinMessagePages(MessageQueue * mqPtr, const char __user * message, unsigned int length)
+{
+    struct MessagePages * large;
+    unsigned long start = (unsigned long)message;
+    unsigned int pinnedCount = 0u;
+    unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+    int ret;
+
+    large = kzalloc(sizeof(*large), GFP_KERNEL);
+    if (large == NULL)
+    {
+        LOG("Could not allocate the page descriptor.");
+        MQ_STAT_ADD(mqPtr, allocFailures, 1u);
+        return NULL;
+    }
+
+    /* length is bounded by MESSAGE_SIZE_MAX, but keep the sum from wrapping anyway. */
+    large->offset = offset_in_page(start);
+    large->charged = (unsigned int)DIV_ROUND_UP((size_t)large->offset + length, PAGE_SIZE);
+    large->mm = current->mm;
+    mmgrab(large->mm);
+    refcount_set(&large->refs, 1);
+    init_waitqueue_head(&large->wait);
+
+    if ((atomic64_add_return(large->charged, &large->mm->pinned_vm) > limit) && !capable(CAP_IPC_LOCK))
+    {
+        LOG("Pinning the message would exceed RLIMIT_MEMLOCK.");
+        PutMessagePages(large);
+        return NULL;
+    }
+
+    large->pages = kvmalloc_array(large->charged, sizeof(struct page *), GFP_KERNEL);
+    if (large->pages == NULL)
+    {
+        LOG("Could not allocate the page array.");
+        MQ_STAT_ADD(mqPtr, allocFailures, 1u);
+        PutMessagePages(large);
+        return NULL;
+    }
+
+    LOG("Pinning sender pages.");
+    while (pinnedCount < large->charged)
+    {
+        ret = pin_user_pages_fast((start & PAGE_MASK) + ((unsigned long)pinnedCount << PAGE_SHIFT),
+                                  large->charged - pinnedCount, FOLL_LONGTERM, &large->pages[pinnedCount]);
+        if (ret <= 0)
+        {
+            break;
+        }
+        pinnedCount += (unsigned int)ret;
+    }
+
+    large->count = pinnedCount;
+    if (pinnedCount != large->charged)
+    {
+        LOG("Pinning sender pages failed.");
+        PutMessagePages(large);
+        return NULL;
+    }
+
+    return large;
+}
+
+/*
+ * Puts a free slot holding the message on its priority list. Called with
+ * queueLock held and send credit available; the caller wakes a receiver
+ * once the lock is dropped.
+ */
+static MessageSlot * QueueSlot(MessageQueue * mqPtr, char * buffer, struct MessagePages * pinned, unsigned int length, unsigned int priority)
+{
+    /* The window guarantees a free slot while we have credit. */
+    MessageSlot * slot = list_first_entry(&mqPtr->free, MessageSlot, node);
+
+    slot->buffer = buffer;
+    slot->pinned = pinned;
+    slot->len = length;
+    slot->priority = priority;
+    slot->enqueueTime = ktime_get_ns();
+    slot->sequence = ++mqPtr->sent;
+    slot->tgid = task_tgid_nr(current);
+    list_move_tail(&slot->node, &mqPtr->queued[priority]);
+    __set_bit(priority, &mqPtr->prioMap);
+    WRITE_ONCE(mqPtr->tail, mqPtr->tail + 1u);
+    NotePeakDepth(mqPtr, mqPtr->tail - mqPtr->head);
+
+    trace_mq_enqueue(mqPtr->id, slot->sequence, length, priority, slot->enqueueTime);
+    MQ_STAT_ADD(mqPtr, sends, 1u);
+    MQ_STAT_ADD(mqPtr, sendBytes, length);
+
+    MarkReady(mqPtr);
+
+    return slot;
+}
+
+/* Returns the oldest queued message of the highest priority, in O(1). */
+static inline MessageSlot * NextSlot(MessageQueue * mqPtr)
+{
+    return list_first_entry(&mqPtr->queued[__fls(mqPtr->prioMap)], MessageSlot, node);
+}
+
+/*
+ * Takes the next message for copying out. Called with queueLock held and
+ * the queue non-empty; the copy happens after the lock is dropped and ends
+ * with FinishClaim().
+ */
+static MessageSlot * ClaimSlot(MessageQueue * mqPtr)
+{
+    MessageSlot * slot = NextSlot(mqPtr);
+
+    list_move_tail(&slot->node, &mqPtr->received);
+    if (list_empty(&mqPtr->queued[slot->priority]))
+    {
+        __clear_bit(slot->priority, &mqPtr->prioMap);
+    }
+
+    slot->busy = true;
+    if (slot->pinned != NULL)
+    {
+        slot->pinned->claimed = true;
+    }
+    WRITE_ONCE(mqPtr->head, mqPtr->head + 1u);
+    slot->ackSequence = mqPtr->head;
+
+    trace_mq_receive(mqPtr->id, slot->sequence, slot->len, slot->enqueueTime);
+    MQ_STAT_ADD(mqPtr, receives, 1u);
+    MQ_STAT_ADD(mqPtr, receiveBytes, slot->len);
+    NoteReceiveLatency(mqPtr, slot->enqueueTime);
+
+    return slot;
+}
+
+/*
+ * Queues a message with send credit and wakes a receiver for it. If the
+ * queue was empty and the longest-parked receiver has room for the message,
+ * it is claimed for that receiver in the same queueLock hold and only that
+ * task is woken, so no other receiver can take it. Called with queueLock
+ * held, which it drops. Returns the queued slot.
+ */
+static MessageSlot * QueueAndWake(MessageQueue * mqPtr, char * buffer, struct MessagePages * pinned, unsigned int length, unsigned int priority)
+{
+    struct MessageHandoff * handoff = NULL;
+    MessageSlot * slot;
+
+    if (RingEmpty(mqPtr) && !list_empty(&mqPtr->parked))
+    {
+        handoff = list_first_entry(&mqPtr->parked, struct MessageHandoff, node);
+        if (length > handoff->capacity)
+        {
+            handoff = NULL;
+        }
+    }
+
+    slot = QueueSlot(mqPtr, buffer, pinned, length, priority);
+
+    if (handoff != NULL)
+    {
+        LOG("Handed message to a parked receiver.");
+        list_del_init(&handoff->node);
+        handoff->slot = ClaimSlot(mqPtr);
+        wake_up_process(handoff->task);
+
+        spin_unlock(&mqPtr->queueLock);
+    }
+    else
+    {
+        spin_unlock(&mqPtr->queueLock);
+
+        WakeReceivers(mqPtr, 1u);
+    }
+
+    return slot;
+}
+
+/*
+ * Takes a queued slot back off mqPtr before anyone received it and returns
+ * its credit. Called with queueLock held.
+ */
+static void WithdrawSlot(MessageQueue * mqPtr, MessageSlot * slot)
+{
+    list_move(&slot->node, &mqPtr->free);
+    if (list_empty(&mqPtr->queued[slot->priority]))
+    {
+        __clear_bit(slot->priority, &mqPtr->prioMap);
+    }
+
+    /* The sender holds its own reference until the slot is withdrawn, so this is never the last. */
+    refcount_dec(&slot->pinned->refs);
+    slot->pinned = NULL;
+    WRITE_ONCE(mqPtr->tail, mqPtr->tail - 1u);
+
+    MQ_STAT_SUB(mqPtr, sends, 1u);
+    MQ_STAT_SUB(mqPtr, sendBytes, slot->len);
+}
+
+/*
+ * Withdraws every queued message that still points at its sender's pages
+ * and wakes the senders, which fail with -EIDRM. Called with queueLock held
+ * once the queue is marked dead.
+ */
+static void WithdrawPinnedSlots(MessageQueue * mqPtr)
+{
+    MessageSlot * slot;
+    MessageSlot * next;
+    unsigned int priority;
+
+    if (mqPtr->slots == NULL)
+    {
+        return;
+    }
+
+    for (priority = 0u; priority < MQ_PRIO_MAX; priority++)
+    {
+        list_for_each_entry_safe(slot, next, &mqPtr->queued[priority], node)
+        {
+            struct MessagePages * pinned = slot->pinned;
+
+            if (pinned != NULL)
+            {
+                WithdrawSlot(mqPtr, slot);
+                pinned->done = true;
+                wake_up(&pinned->wait);
+            }
+        }
+    }
+}
+
+/*
+ * Sends a large message, or one a receiver is parked for, from the
+ * sender's pinned pages: waits for credit, pins the pages, queues the
+ * message (handing it to a parked receiver if there is one) and waits until
+ * a receiver has copied it out, until deadline or until a signal. A message
+ * nobody has started to receive by then is withdrawn again; one already
+ * being copied out counts as sent. Pages that cannot be pinned are copied
+ * into a kernel buffer and queued like any other message. Returns E_OK or a
+ * negative errno.
+ */
+static int SendPinnedMessage(MessageQueue * mqPtr, const char __user * message, unsigned int length, unsigned int priority, ktime_t * deadline)
+{
+    struct MessagePages * large;
+    char * buffer = NULL;
+    MessageSlot * slot;
+    DEFINE_WAIT(wait);
+    int ret = 0;
+    int status;
+
+    /* Nothing is pinned while the sender waits for the window to open. */
+    status = WaitForCredit(mqPtr, deadline);
+    if (E_OK != status)
+    {
+        return status;
+    }
+
+    /* Pinning may sleep, so the credit is held for it without queueLock. */
+    WRITE_ONCE(mqPtr->reserved, mqPtr->reserved + 1u);
+    spin_unlock(&mqPtr->queueLock);
+
+    large = PinMessagePages(mqPtr, message, length);
+    if (large == NULL)
+    {
+        LOG("Copying the message in instead.");
+        buffer = AllocMessageBuffer(mqPtr, length);
+        if (buffer == NULL)
+        {
+            status = -ENOMEM;
+        }
+        else if (0u != copy_from_user(buffer, message, length))
+        {
+            LOG("User space to kernel space copy failed.");
+            FreeMessageBuffer(mqPtr, buffer, length);
+            buffer = NULL;
+            status = -EFAULT;
+        }
+    }
+
+    LockQueue(mqPtr);
+    WRITE_ONCE(mqPtr->reserved, mqPtr->reserved - 1u);
+
+    if ((E_OK == status) && mqPtr->dead)
+    {
+        LOG("Queue was deleted.");
+        status = -EIDRM;
+    }
+
+    if (E_OK != status)
+    {
+        spin_unlock(&mqPtr->queueLock);
+
+        /* Hand the credit back. */
+        WakeSenders(mqPtr, 1u);
+        if (large != NULL)
+        {
+            PutMessagePages(large);
+        }
+        if (buffer != NULL)
+        {
+            FreeMessageBuffer(mqPtr, buffer, length);
+        }
+        return status;
+    }
+
+    if (buffer != NULL)
+    {
+        QueueAndWake(mqPtr, buffer, NULL, length, priority);
+
+        return E_OK;
+    }
+
+    /* The queued slot's reference. */
+    refcount_inc(&large->refs);
+    slot = QueueAndWake(mqPtr, NULL, large, length, priority);
+
+    LOG("Waiting for a receiver to copy the message out.");
+    MQ_STAT_ADD(mqPtr, sendBlocks, 1u);
+    atomic_inc(&mqPtr->sendSleepers);
+    for (;;)
+    {
+        prepare_to_wait(&large->wait, &wait, TASK_INTERRUPTIBLE);
+
+        if (READ_ONCE(large->done) || READ_ONCE(large->claimed))
+        {
+            break;
+        }
+
+        if (signal_pending(current))
+        {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        ret = ScheduleUntil(deadline);
+        if (0 != ret)
+        {
+            break;
+        }
+    }
+    finish_wait(&large->wait, &wait);
+
+    /* claimed and done only change under queueLock. */
+    LockQueue(mqPtr);
+
+    if (!large->claimed && !large->done)
+    {
+        LOG("Withdrawing the message.");
+        WithdrawSlot(mqPtr, slot);
+        status = ret;
+    }
+    else
+    {
+        status = large->claimed ? E_OK : -EIDRM;
+    }
+
+    spin_unlock(&mqPtr->queueLock);
+
+    if (E_OK != status)
+    {
+        WakeSenders(mqPtr, 1u);
+    }
+    else if (0 != wait_event_killable(large->wait, READ_ONCE(large->done)))
+    {
+        /*
+         * The copy-out is up to the receiver and its buffer may be slow to
+         * fault in, so a fatal signal does not wait for it; the slot's
+         * reference keeps the pages pinned until the receiver is done.
+         */
+        LOG("Killed while a receiver was copying the message out.");
+        status = -EINTR;
+    }
+
+    atomic_dec(&mqPtr->sendSleepers);
+
+    PutMessagePages(large);
+
+    return status;
+}
+
+/*
+ * Copies one message in from user space and queues it on mqPtr at the given
+ * priority, blocking while the ring is full or until deadline if one is
+ * given. Only plain queues take a non-zero priority. The caller holds a
+ * reference on mqPtr.
+ */
+static int SendMessage(MessageQueue * mqPtr, const char __user * message, unsigned int length, unsigned int priority, ktime_t * deadline)
+{
+    int status = -ENOMEM;
+
+    trace_mq_send(mqPtr->id, length);
+
+    if ((priority >= MQ_PRIO_MAX) || ((0u != priority) && (mqPtr->slots == NULL)))
+    {
+        LOG("Invalid priority, or the queue does not support priorities.");
+        return -EINVAL;
+    }
+
+    /* Every send path, including the sharded one, is bounded here before anything is allocated. */
+    if (length > MESSAGE_SIZE_MAX)
+    {
+        LOG("Message is too large.");
+        return -EMSGSIZE;
+    }
+
+    if (mqPtr->ring != NULL)
+    {
+        return SendRingMessage(mqPtr, message, length, deadline);
+    }
+
+    if (mqPtr->shards != NULL)
+    {
+        return SendShardMessage(mqPtr, message, length, deadline);
+    }
+
+    /*
+     * Large messages, and any message a receiver is parked for, are copied
+     * once, straight out of the sender's pinned pages into the receiver's
+     * buffer. Callers that must not block cannot wait for a receiver, so
+     * they copy.
+     */
+    if (((length > MESSAGE_PIN_MIN) || !list_empty_careful(&mqPtr->parked)) && !MustNotBlock(mqPtr, deadline))
+    {
+        return SendPinnedMessage(mqPtr, message, length, priority, deadline);
+    }
+
+    LOG("Creating message buffer.");
+    char * buffer = AllocMessageBuffer(mqPtr, length);
+    if (buffer != NULL)
+    {
+        LOG("Copying message from user space to kernel space.");
+        if (0u != copy_from_user(buffer, message, length))
+        {
+            LOG("User space to kernel space copy failed.");
+            FreeMessageBuffer(mqPtr, buffer, length);
+            status = -EFAULT;
+        }
+        else if (E_OK != (status = WaitForCredit(mqPtr, deadline)))
+        {
+            FreeMessageBuffer(mqPtr, buffer, length);
+        }
+        else
+        {
+            QueueAndWake(mqPtr, buffer, NULL, length, priority);
+
+            status = E_OK;
+        }
+    }
+    else
+    {
+        LOG("Could not create message buffer.");
+    }
+
+    return status;
+}
+
+/*
+ * Reads an absolute CLOCK_REALTIME deadline from user space. A NULL pointer
+ * means no deadline and leaves *deadline untouched.
+ */
+static int GetDeadline(const struct __kernel_timespec __user * absTimeout, ktime_t * deadline)
+{
+    struct timespec64 ts;
+
+    if (absTimeout == NULL)
+    {
+        return E_OK;
+    }
+
+    if (0 != get_timespec64(&ts, absTimeout))
+    {
+        LOG("Copying timeout from user space failed.");
+        return -EFAULT;
+    }
+
+    if (!timespec64_valid(&ts))
+    {
+        LOG("Invalid timeout.");
+        return -EINVAL;
+    }
+
+    *deadline = timespec64_to_ktime(ts);
+
+    return E_OK;
+}
+
+/*
+ * Acknowledges every received slot below ring index upTo and releases, in
+ * receive order, as many acknowledged slots as are not still being copied
+ * out, returning how many were released. Called with queueLock held; the
+ * caller wakes that many senders once the lock is dropped.
+ */
+static unsigned int ReleaseSlots(MessageQueue * mqPtr, unsigned long upTo)
+{
+    struct MessageLatency __percpu * latency = LatencyOf(mqPtr);
+    u64 now = (latency != NULL) ? ktime_get_ns() : 0u;
+    unsigned int released = 0u;
+
+    if (upTo > mqPtr->ackTo)
+    {
+        mqPtr->ackTo = upTo;
+    }
+
+    while (!list_empty(&mqPtr->received))
+    {
+        MessageSlot * slot = list_first_entry(&mqPtr->received, MessageSlot, node);
+
+        if (slot->busy)
+        {
+            /* Its receiver releases it, and anything after it, when done. */
+            break;
+        }
+
+        if ((mqPtr->ackHead >= mqPtr->ackTo) && !slot->acked)
+        {
+            break;
+        }
+
+        if (latency != NULL)
+        {
+            this_cpu_inc(latency->ack[LatencyBucket(now - slot->enqueueTime)]);
+        }
+
+        FreeMessageBuffer(mqPtr, slot->buffer, slot->len);
+        slot->buffer = NULL;
+        slot->acked = false;
+        list_move(&slot->node, &mqPtr->free);
+        WRITE_ONCE(mqPtr->ackHead, mqPtr->ackHead + 1u);
+        released++;
+    }
+
+    if (0u != released)
+    {
+        LOG("Released received slots.");
+        trace_mq_ack(mqPtr->id, mqPtr->ackHead);
+        MQ_STAT_ADD(mqPtr, acks, released);
+    }
+
+    return released;
+}
+
+/*
+ * Copies a claimed message out to user space, from its kernel buffer or
+ * page by page from its sender's pinned pages. Returns the number of bytes
+ * not copied, like copy_to_user().
+ */
+static unsigned long CopySlotToUser(char __user * buffer, MessageSlot * slot, unsigned int len)
+{
+    struct MessagePages * pinned = slot->pinned;
+    unsigned int offset;
+    unsigned int index;
+    unsigned int copied = 0u;
+
+    if (pinned == NULL)
+    {
+        return copy_to_user(buffer, slot->buffer, len);
+    }
+
+    offset = pinned->offset;
+    for (index = 0u; copied < len; index++)
+    {
+        unsigned int chunk = min_t(unsigned int, len - copied, PAGE_SIZE - offset);
+        char * page = kmap_local_page(pinned->pages[index]);
+        unsigned long left = copy_to_user(buffer + copied, page + offset, chunk);
+
+        kunmap_local(page);
+        if (0u != left)
+        {
+            return len - copied - chunk + left;
+        }
+
+        copied += chunk;
+        offset = 0u;
+    }
+
+    return 0u;
+}
+
+/*
+ * Ends a copy-out, lets the sender of a pinned message return and wakes
+ * senders for any acks that were held up by it. With ack set the message is
+ * also acknowledged, without acknowledging any other receiver's.
+ */
+static void FinishClaim(MessageQueue * mqPtr, MessageSlot * slot, bool ack)
+{
+    struct MessagePages * pinned;
+    unsigned int released;
+
+    LockQueue(mqPtr);
+    pinned = slot->pinned;
+    if (pinned != NULL)
+    {
+        pinned->done = true;
+        wake_up(&pinned->wait);
+        slot->pinned = NULL;
+    }
+    slot->busy = false;
+    slot->acked = ack;
+    released = ReleaseSlots(mqPtr, mqPtr->ackTo);
+    spin_unlock(&mqPtr->queueLock);
+
+    WakeSenders(mqPtr, released);
+
+    if (pinned != NULL)
+    {
+        PutMessagePages(pinned);
+    }
+}
+
+/*
+ * Parks the caller for a direct handoff while mqPtr is empty. Returns the
+ * slot a sender claimed for the caller, to be copied out and finished like
+ * one from ClaimSlot(). Otherwise returns NULL with *status set to the
+ * error that ended the wait, or to E_OK if the caller should fall back to
+ * WaitForMessage() because a message was queued instead.
+ */
+static MessageSlot * ParkReceiver(MessageQueue * mqPtr, size_t capacity, ktime_t * deadline, int * status)
+{
+    struct MessageHandoff handoff;
+    DEFINE_WAIT(wait);
+    bool pending;
+    int ret = 0;
+
+    *status = E_OK;
+    handoff.task = current;
+    handoff.capacity = capacity;
+    handoff.slot = NULL;
+
+    LockQueue(mqPtr);
+    if (!RingEmpty(mqPtr) || mqPtr->dead)
+    {
+        spin_unlock(&mqPtr->queueLock);
+        return NULL;
+    }
+    list_add_tail(&handoff.node, &mqPtr->parked);
+    spin_unlock(&mqPtr->queueLock);
+
+    LOG("Parked for a direct handoff.");
+    MQ_STAT_ADD(mqPtr, receiveBlocks, 1u);
+    atomic_inc(&mqPtr->receiveSleepers);
+    for (;;)
+    {
+        prepare_to_wait_exclusive(&mqPtr->receiveWait, &wait, TASK_INTERRUPTIBLE);
+
+        if ((READ_ONCE(handoff.slot) != NULL) || !RingEmpty(mqPtr) || READ_ONCE(mqPtr->dead))
+        {
+            break;
+        }
+
+        if (signal_pending(current))
+        {
+            ret = -ERESTARTSYS;
+            break;
+        }
+
+        ret = ScheduleUntil(deadline);
+        if (0 != ret)
+        {
+            break;
+        }
+    }
+    finish_wait(&mqPtr->receiveWait, &wait);
+    atomic_dec(&mqPtr->receiveSleepers);
+
+    /* Senders only touch handoff under queueLock, so this also waits them out. */
+    LockQueue(mqPtr);
+    if (handoff.slot == NULL)
+    {
+        list_del(&handoff.node);
+    }
+    pending = !RingEmpty(mqPtr);
+    spin_unlock(&mqPtr->queueLock);
+
+    /* A wakeup meant for a queued message may have ended up here. */
+    if (((handoff.slot != NULL) || (0 != ret)) && pending)
+    {
+        WakeReceivers(mqPtr, 1u);
+    }
+
+    /* A message handed over is ours even if a signal or the deadline came too. */
+    if ((handoff.slot == NULL) && (0 != ret))
+    {
+        LOG("Gave up waiting for a message.");
+        *status = ret;
+    }
+
+    return handoff.slot;
+}
+
+/*
+ * Takes the oldest message of the highest priority off mqPtr and copies it
+ * out to user space, blocking while the queue is empty or until deadline if
+ * one is given. The message's metadata is stored to info unless it is NULL.
+ * With ack set the message is acknowledged as soon as it has been copied
+ * out. A message larger than capacity stays queued; one that cannot be
+ * copied out is consumed all the same. Returns the message length or a
+ * negative errno. The caller holds a reference on mqPtr.
+ */
+static int ReceiveMessage(MessageQueue * mqPtr, char __user * buffer, size_t capacity, struct MessageInfo * info, ktime_t * deadline, bool ack)
+{
+    MessageSlot * slot = NULL;
+    unsigned int len;
+    int status;
+
+    if (mqPtr->ring != NULL)
+    {
+        return ReceiveRingMessage(mqPtr, buffer, capacity, info, deadline);
+    }
+
+    if (mqPtr->shards != NULL)
+    {
+        return ReceiveShardMessage(mqPtr, buffer, capacity, info, deadline);
+    }
+
+    if (RingEmpty(mqPtr) && !MustNotBlock(mqPtr, deadline))
+    {
+        slot = ParkReceiver(mqPtr, capacity, deadline, &status);
+        if (E_OK != status)
+        {
+            return status;
+        }
+    }
+
+    if (slot == NULL)
+    {
+        status = WaitForMessage(mqPtr, deadline);
+        if (E_OK != status)
+        {
+            return status;
+        }
+
+        if (NextSlot(mqPtr)->len > capacity)
+        {
+            LOG("Message does not fit the receive buffer.");
+            spin_unlock(&mqPtr->queueLock);
+            /* The message stays queued; pass on the wakeup it may have cost. */
+            WakeReceivers(mqPtr, 1u);
+            return -EMSGSIZE;
+        }
+
+        slot = ClaimSlot(mqPtr);
+
+        spin_unlock(&mqPtr->queueLock);
+    }
+
+    len = slot->len;
+
+    LOG("Copying message from kernel space to user space.");
+    if (0u != CopySlotToUser(buffer, slot, len))
+    {
+        LOG("Copying from kernel space to user space failed.");
+        status = -EFAULT;
+    }
+    else
+    {
+        LOG("Copying successful.");
+        FillMessageInfo(info, slot, 0u);
+        status = (int)len;
+    }
+
+    FinishClaim(mqPtr, slot, ack);
+
+    return status;
+}
+
+/*
+ * Ends a receive for the syscalls that report the length and priority
+ * through user pointers, either of which may be NULL. Returns E_OK or the
+ * error from ReceiveMessage() or the copy-out.
+ */
+static int PutMessageInfo(int status, struct MessageInfo * info, unsigned int __user * length, unsigned int __user * priority)
+{
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (((length != NULL) && (0 != put_user(info->length, length))) ||
+        ((priority != NULL) && (0 != put_user(info->priority, priority))))
+    {
+        LOG("Copying from kernel space to user space failed.");
+        return -EFAULT;
+    }
+
+    return E_OK;
+}
+
+SYSCALL_DEFINE3(create_queue, unsigned int, queueId, unsigned int, depth, unsigned int, flags)
+{
+    LOG("Entering create_queue system call.");
+
+    int status = -EINVAL;
+    MessageQueue * mqPtr;
+
+    if (0u == depth)
+    {
+        /* Shared rings are indexed by mask, so their depth is a power of two. */
+        depth = (0u != (flags & MQ_FLAG_SHARED)) ? roundup_pow_of_two(QUEUE_MAX) : QUEUE_MAX;
+    }
+
+    if (depth > QUEUE_DEPTH_MAX)
+    {
+        LOG("Requested queue depth is too large.");
+    }
+    else if ((0u != (flags & MQ_FLAG_SHARED)) && !is_power_of_2(depth))
+    {
+        LOG("A shared ring depth must be a power of two.");
+    }
+    else if (0u != (flags & ~MQ_FLAGS_ALL))
+    {
+        LOG("Unknown queue flags.");
+    }
+    else if ((0u != (flags & MQ_FLAG_SHARDED)) && (0u != (flags & MQ_FLAG_SHARED)))
+    {
+        LOG("A shared ring cannot be sharded.");
+    }
+    else if ((0u != (flags & MQ_FLAG_ORDERED)) && (0u == (flags & MQ_FLAG_SHARDED)))
+    {
+        LOG("Only sharded queues take MQ_FLAG_ORDERED.");
+    }
+    else if (NULL == (mqPtr = GetMessageQueue(queueId)))
+    {
+        LOG("Creating new message queue.");
+        status = -ENOMEM;
+        mqPtr = (MessageQueue*)kmem_cache_zalloc(queueCache, GFP_KERNEL);
+        if (mqPtr != NULL)
+        {
+            mqPtr->stats = alloc_percpu(struct MessageQueueStats);
+            if ((mqPtr->stats != NULL) && AllocMessageStorage(mqPtr, depth, flags))
+            {
+                mqPtr->id = queueId;
+                mqPtr->depth = depth;
+                mqPtr->window = depth;
+                mqPtr->head = 0u;
+                mqPtr->tail = 0u;
+                mqPtr->ackHead = 0u;
+                mqPtr->ackTo = 0u;
+                mqPtr->dead = false;
+                mqPtr->nonblock = (0u != (flags & MQ_FLAG_NONBLOCK));
+                mqPtr->ordered = (0u != (flags & MQ_FLAG_ORDERED));
+
+                /* The registry owns the initial reference. */
+                refcount_set(&mqPtr->refs, 1);
+
+                init_waitqueue_head(&mqPtr->receiveWait);
+                init_waitqueue_head(&mqPtr->sendWait);
+                spin_lock_init(&mqPtr->queueLock);
+                mutex_init(&mqPtr->ringLock);
+                INIT_LIST_HEAD(&mqPtr->setNode);
+                INIT_LIST_HEAD(&mqPtr->readyNode);
+
+                status = AddMessageQueue(queueId, mqPtr);
+                if (E_OK == status)
+                {
+                    trace_mq_create(queueId, depth, flags);
+                }
+                else
+                {
+                    LOG("Could not register message queue.");
+                    FreeMessageStorage(mqPtr);
+                    free_percpu(mqPtr->stats);
+                    kmem_cache_free(queueCache, mqPtr);
+
+                    /* Another caller may have registered the same queueId meanwhile. */
+                    mqPtr = GetMessageQueue(queueId);
+                    if (mqPtr != NULL)
+                    {
+                        PutMessageQueue(mqPtr);
+                        status = E_OK;
+                    }
+                }
+            }
+            else
+            {
+                LOG("Could not create message ring.");
+                free_percpu(mqPtr->stats);
+                kmem_cache_free(queueCache, mqPtr);
+            }
+        }
+    }
+    else
+    {
+        LOG("Message queue already exists.");
+        PutMessageQueue(mqPtr);
+        status = E_OK;
+    }
+
+    LOG("Exiting create_queue system call.");
+
+    return status;
+}
+
+SYSCALL_DEFINE1(delete_queue, unsigned int, queueId)
+{
+    LOG("Entering delete_queue system call.");
+
+    int status = -ENOENT;
+
+    MessageQueue * mqPtr = RemoveMessageQueue(queueId);
+
+    if (mqPtr != NULL)
+    {
+        trace_mq_delete(queueId);
+
+        LockQueue(mqPtr);
+        WRITE_ONCE(mqPtr->dead, true);
+        WithdrawPinnedSlots(mqPtr);
+        if (mqPtr->set != NULL)
+        {
+            DetachFromSet(mqPtr, mqPtr->set);
+        }
+        spin_unlock(&mqPtr->queueLock);
+
+        LOG("Waking blocked senders and receivers.");
+        wake_up_all(&mqPtr->receiveWait);
+        wake_up_all(&mqPtr->sendWait);
+
+        /* Buffers are released once the last in-flight caller drops its reference. */
+        PutMessageQueue(mqPtr);
+
+        status = E_OK;
+    }
+    else
+    {
+        LOG("Queue does not exist.");
+    }
+
+    LOG("Exiting delete_queue system call.");
+    
+    return status;
+}
+
+SYSCALL_DEFINE3(msg_send, unsigned int, queueId, char *, message, unsigned int, length)
+{
+    LOG("Entering msg_send system call.");
+
+    int status = -ENOENT;
+
+    MessageQueue * mqPtr = GetMessageQueue(queueId);
+
+    if (mqPtr != NULL)
+    {
+        status = SendMessage(mqPtr, message, length, 0u, NULL);
+
+        PutMessageQueue(mqPtr);
+    }
+    else
+    {
+        LOG("Queue does not exist.");
+    }
+
+    LOG("Exiting msg_send system call.");
+    
+    return status;
+}
+
+/*
+ * Sends count messages described by descriptors in one kernel entry. Each
+ * distinct queue is looked up once (up to MSG_BATCH_QUEUES of them; further
+ * queues are looked up per entry) and the per-entry result is written back
+ * to the descriptor's status field. Returns E_OK only if every entry was
+ * sent, else the error of the first entry that failed. A signal ends the
+ * batch with -EINTR, never a restart, since earlier entries are queued.
+ */
+SYSCALL_DEFINE2(msg_send_batch, struct MessageDescriptor *, descriptors, unsigned int, count)
+{
+    LOG("Entering msg_send_batch system call.");
+
+    int status = -EINVAL;
+    struct
+    {
+        unsigned int queueId;
+        MessageQueue * mqPtr;
+    } cache[MSG_BATCH_QUEUES];
+    unsigned int cached = 0u;
+    unsigned int index;
+    unsigned int entry;
+
+    if ((0u == count) || (count > MSG_BATCH_MAX))
+    {
+        LOG("Invalid batch size.");
+    }
+    else
+    {
+        status = E_OK;
+
+        for (index = 0u; index < count; index++)
+        {
+            struct MessageDescriptor descriptor;
+            MessageQueue * mqPtr = NULL;
+            bool uncached = false;
+            int entryStatus = -ENOENT;
+
+            if (0u != copy_from_user(&descriptor, &descriptors[index], sizeof(descriptor)))
+            {
+                LOG("Copying descriptor from user space failed.");
+                status = -EFAULT;
+                break;
+            }
+
+            for (entry = 0u; entry < cached; entry++)
+            {
+                if (cache[entry].queueId == descriptor.queueId)
+                {
+                    mqPtr = cache[entry].mqPtr;
+                    break;
+                }
+            }
+
+            if (mqPtr == NULL)
+            {
+                mqPtr = GetMessageQueue(descriptor.queueId);
+                if ((mqPtr != NULL) && (cached < MSG_BATCH_QUEUES))
+                {
+                    cache[cached].queueId = descriptor.queueId;
+                    cache[cached].mqPtr = mqPtr;
+                    cached++;
+                }
+                else
+                {
+                    uncached = true;
+                }
+            }
+
+            if (mqPtr != NULL)
+            {
+                entryStatus = SendMessage(mqPtr, descriptor.message, descriptor.length, 0u, NULL);
+
+                /*
+                 * A restart would send the entries before this one again, and
+                 * -ERESTARTSYS must not reach user space in a status field.
+                 */
+                if (-ERESTARTSYS == entryStatus)
+                {
+                    entryStatus = -EINTR;
+                }
+
+                if (uncached)
+                {
+                    PutMessageQueue(mqPtr);
+                }
+            }
+            else
+            {
+                LOG("Queue does not exist.");
+            }
+
+            if ((E_OK == status) && (E_OK != entryStatus))
+            {
+                status = entryStatus;
+            }
+
+            if (0 != put_user(entryStatus, &descriptors[index].status))
+            {
+                LOG("Copying status to user space failed.");
+                status = -EFAULT;
+                break;
+            }
+
+            /* Stop early if the caller is being signalled rather than blocking on the next entry. */
+            if (signal_pending(current))
+            {
+                if (E_OK == status)
+                {
+                    status = -EINTR;
+                }
+                break;
+            }
+        }
+
+        for (entry = 0u; entry < cached; entry++)
+        {
+            PutMessageQueue(cache[entry].mqPtr);
+        }
+    }
+
+    LOG("Exiting msg_send_batch system call.");
+
+    return status;
+}
+
+SYSCALL_DEFINE3(msg_receive, unsigned int, queueId, char *, buffer, unsigned int *, length)
+{
+    LOG("Entering msg_receive system call.");
+
+    int status = -ENOENT;
+
+    MessageQueue * mqPtr = GetMessageQueue(queueId);
+
+    if (mqPtr != NULL)
+    {
+        /* msg_receive has no capacity argument; the caller sizes its buffer. */
+        struct MessageInfo info;
+
+        status = PutMessageInfo(ReceiveMessage(mqPtr, buffer, SIZE_MAX, &info, NULL, false), &info, length, NULL);
+
+        PutMessageQueue(mqPtr);
+    }
+    else
+    {
+        LOG("Queue does not exist.");
+    }
+
+    LOG("Exiting msg_receive system call.");
+    
+    return status;
+}
+
+/*
+ * Receives up to count messages into the caller's vector, blocking only if
+ * the queue is empty. The messages it takes are acknowledged as they are
+ * copied out; messages other receivers hold are left alone. The number of
+ * filled entries is written to received. A message
+ * larger than its entry's capacity stays queued and ends the batch; if it is
+ * the first one the call fails and reports the needed size in that entry's
+ * length.
+ */
+SYSCALL_DEFINE4(msg_receive_batch, unsigned int, queueId, struct MessageVector *, vector, unsigned int, count, unsigned int *, received)
+{
+    LOG("Entering msg_receive_batch system call.");
+
+    int status = -EINVAL;
+    unsigned int filled = 0u;
+    bool woken = false;
+    bool pending;
+
+    MessageQueue * mqPtr = NULL;
+
+    if ((0u == count) || (count > MSG_BATCH_MAX))
+    {
+        LOG("Invalid batch size.");
+    }
+    else if (NULL == (mqPtr = GetMessageQueue(queueId)))
+    {
+        LOG("Queue does not exist.");
+        status = -ENOENT;
+    }
+    else
+    {
+        /*
+         * Each message is claimed under the lock and copied out without it.
+         * The first one is claimed under the same lock hold that saw it
+         * arrive, so a woken batch never comes back empty-handed.
+         */
+        while (filled < count)
+        {
+            struct MessageVector entry;
+            MessageSlot * slot;
+            unsigned int len;
+
+            if (0u != copy_from_user(&entry, &vector[filled], sizeof(entry)))
+            {
+                LOG("Copying vector entry from user space failed.");
+                status = -EFAULT;
+                break;
+            }
+
+            if (0u == filled)
+            {
+                status = WaitForMessage(mqPtr, NULL);
+                if (E_OK != status)
+                {
+                    break;
+                }
+                woken = true;
+            }
+            else
+            {
+                LockQueue(mqPtr);
+
+                if (RingEmpty(mqPtr))
+                {
+                    spin_unlock(&mqPtr->queueLock);
+                    break;
+                }
+            }
+
+            len = NextSlot(mqPtr)->len;
+            if (len > entry.capacity)
+            {
+                spin_unlock(&mqPtr->queueLock);
+
+                LOG("Message does not fit the receive buffer.");
+                if (0u == filled)
+                {
+                    (void)put_user(len, &vector[filled].length);
+                    status = -EMSGSIZE;
+                }
+                break;
+            }
+
+            slot = ClaimSlot(mqPtr);
+
+            spin_unlock(&mqPtr->queueLock);
+
+            if ((0u != CopySlotToUser(entry.buffer, slot, len)) ||
+                (0 != put_user(len, &vector[filled].length)))
+            {
+                LOG("Copying from kernel space to user space failed.");
+                /* Like msg_receive, a message that cannot be copied out is consumed. */
+                FinishClaim(mqPtr, slot, true);
+                status = -EFAULT;
+                break;
+            }
+
+            FinishClaim(mqPtr, slot, true);
+            filled++;
+        }
+
+        /* Messages already handed out count as delivered even if a later entry failed. */
+        if (0u != filled)
+        {
+            status = E_OK;
+        }
+
+        /* We were woken for one message; wake the next receiver if more are queued. */
+        if (woken)
+        {
+            LockQueue(mqPtr);
+            pending = !RingEmpty(mqPtr);
+            spin_unlock(&mqPtr->queueLock);
+
+            if (pending)
+            {
+                WakeReceivers(mqPtr, 1u);
+            }
+        }
+
+        PutMessageQueue(mqPtr);
+    }
+
+    if (0 != put_user(filled, received))
+    {
+        LOG("Copying received count to user space failed.");
+        status = -EFAULT;
+    }
+
+    LOG("Exiting msg_receive_batch system call.");
+
+    return status;
+}
+
+/*
+ * Acknowledges received messages. A sequence of 0 acknowledges the oldest
+ * received message not yet acknowledged; otherwise every received message
+ * with a sequence number up to and including sequence is acknowledged.
+ * Messages are released once acknowledged and no longer being copied out.
+ * Messages not yet received are never acknowledged.
+ */
+SYSCALL_DEFINE2(msg_ack, unsigned int, queueId, unsigned long, sequence)
+{
+    LOG("Entering msg_ack system call.");
+
+    int status = -ENOENT;
+
+    MessageQueue * mqPtr = GetMessageQueue(queueId);
+
+    if (mqPtr != NULL)
+    {
+        unsigned int released = 0u;
+
+        LockQueue(mqPtr);
+
+        if (mqPtr->ackHead != mqPtr->head)
+        {
+            if (0u == sequence)
+            {
+                /* Acks still waiting behind a busy slot must not be counted twice. */
+                LOG("Releasing oldest unacknowledged slot.");
+                released = ReleaseSlots(mqPtr, min(max(mqPtr->ackTo, mqPtr->ackHead) + 1u, mqPtr->head));
+            }
+            else if (sequence > mqPtr->ackHead)
+            {
+                /* Sequence numbers count received messages from one. */
+                LOG("Releasing received slots up to sequence.");
+                released = ReleaseSlots(mqPtr, min(sequence, mqPtr->head));
+            }
+        }
+
+        spin_unlock(&mqPtr->queueLock);
+
+        WakeSenders(mqPtr, released);
+
+        PutMessageQueue(mqPtr);
+
+        status = E_OK;
+    }
+    else
+    {
+        LOG("Queue does not exist.");
+    }
+
+    LOG("Exiting msg_ack system call.");
+
+    return status;
+}
 
-#ifdef DEBUG
-    #define LOG(m) printk("%s: %d : %s\n", __FILE__, __LINE__, m)
-#else
-    #define LOG(m)
-#endif
+static int MessageQueueRelease(struct inode * inode, struct file * file)
+{
+    PutMessageQueue(file->private_data);
 
-#define E_OK 0x0
-#define E_NOK 0xFF
+    return 0;
+}
 
-typedef struct
+/*
+ * The queue file is readable while a message is queued and writable while
+ * the sender has credit (or ring space). A deleted queue reports EPOLLHUP.
+ * Pollers sit on the same wait queues as blocked callers but are never
+ * exclusive, so wake-one events still reach them.
+ */
+static __poll_t MessageQueuePoll(struct file * file, poll_table * wait)
 {
-    unsigned int id;
-    unsigned int len;
-    char * buffer;
-    struct mutex ackLock;
-    struct mutex receiveLock;
-    struct mutex queueLock;
-}MessageQueue;
+    MessageQueue * mqPtr = file->private_data;
+    __poll_t mask = 0;
 
-static DEFINE_MUTEX(globalLock);
+    poll_wait(file, &mqPtr->receiveWait, wait);
+    poll_wait(file, &mqPtr->sendWait, wait);
 
+    if (READ_ONCE(mqPtr->dead))
+    {
+        return EPOLLHUP | EPOLLERR;
+    }
 
-struct QueueList{
-     struct list_head list;
-     int queueId;
-     MessageQueue * mqPtr;
-};
+    if (mqPtr->ring != NULL)
+    {
+        __u32 producer = smp_load_acquire(&mqPtr->ring->producer);
+        __u32 consumer = smp_load_acquire(&mqPtr->ring->consumer);
 
-LIST_HEAD(QueueListHeadNode);
+        if (producer != consumer)
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if ((producer - consumer) < mqPtr->depth)
+        {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+    }
+    else if (mqPtr->shards != NULL)
+    {
+        if (!ShardsEmpty(mqPtr))
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if (!ShardsFull(mqPtr))
+        {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+    }
+    else
+    {
+        if (!RingEmpty(mqPtr))
+        {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if (!WindowFull(mqPtr))
+        {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+    }
 
-void AddMessageQueue(int queueId, MessageQueue * mqPtr);
-void RemoveMessageQueue(int queueId);
-int FindMessageQueue(int queueId);
-int FindMessageQueue(int queueId);
-MessageQueue * GetMessageQueue(int queueId);
+    return mask;
+}
 
-void AddMessageQueue(int queueId, MessageQueue * mqPtr)
+/*
+ * read() receives one message and returns its length. Like
+ * msg_receive_batch it acknowledges the message it returns, and only that
+ * one, so an event loop needs no msg_ack call.
+ */
+static ssize_t MessageQueueRead(struct file * file, char __user * buffer, size_t count, loff_t * pos)
 {
-    struct QueueList *np = kmalloc(sizeof(struct QueueList), GFP_ATOMIC);
-    np->queueId = queueId;
-    np->mqPtr = mqPtr;
-
-    INIT_LIST_HEAD(&np->list);
+    ktime_t noWait = 0;
 
-    list_add_tail(&np->list, &QueueListHeadNode);
+    return ReceiveMessage(file->private_data, buffer, count, NULL, (0u != (file->f_flags & O_NONBLOCK)) ? &noWait : NULL, true);
 }
 
-void RemoveMessageQueue(int queueId)
+/* write() sends the whole buffer as one message, like msg_send. */
+static ssize_t MessageQueueWrite(struct file * file, const char __user * buffer, size_t count, loff_t * pos)
 {
-    struct QueueList *np, *temp;
+    ktime_t noWait = 0;
+    int status;
 
-    list_for_each_entry_safe(np, temp, &QueueListHeadNode, list) {
-            list_del(&np->list);
-            kfree(np);
-        }
+    if (count > INT_MAX)
+    {
+        return -EMSGSIZE;
+    }
+
+    status = SendMessage(file->private_data, buffer, (unsigned int)count, 0u, (0u != (file->f_flags & O_NONBLOCK)) ? &noWait : NULL);
+
+    return (E_OK == status) ? (ssize_t)count : status;
 }
 
-int FindMessageQueue(int queueId)
+static int MessageQueueMmap(struct file * file, struct vm_area_struct * vma)
 {
-    int status = E_NOK;
-    struct QueueList *np;
+    MessageQueue * mqPtr = file->private_data;
 
-    
-    list_for_each_entry(np, &QueueListHeadNode, list) {
-        if (np->queueId == queueId)
-        {
-            status = E_OK;
-            break;
-        }
+    if (mqPtr->ring == NULL)
+    {
+        LOG("Queue has no shared ring to map.");
+        return -ENODEV;
     }
-    
-    return status;
+
+    return remap_vmalloc_range(vma, mqPtr->ring, vma->vm_pgoff);
 }
 
-MessageQueue * GetMessageQueue(int queueId)
+static const struct file_operations MessageQueueFops = {
+    .owner = THIS_MODULE,
+    .release = MessageQueueRelease,
+    .poll = MessageQueuePoll,
+    .read = MessageQueueRead,
+    .write = MessageQueueWrite,
+    .mmap = MessageQueueMmap,
+    .llseek = noop_llseek,
+};
+
+/*
+ * Returns a file descriptor for queueId that keeps the queue alive while it
+ * is open. The descriptor can be polled and read or written one message at a
+ * time without a registry lookup per call; flags may contain O_NONBLOCK. For
+ * MQ_FLAG_SHARED queues the descriptor also maps the shared ring. Returns the
+ * descriptor or a negative errno.
+ */
+SYSCALL_DEFINE2(msg_open, unsigned int, queueId, unsigned int, flags)
 {
-    struct QueueList *np;
-    MessageQueue * mqPtr = NULL;
+    LOG("Entering msg_open system call.");
+
+    long fd = -EINVAL;
+    MessageQueue * mqPtr;
 
-    list_for_each_entry(np, &QueueListHeadNode, list) {
-        if ( np->queueId == queueId)
+    if (0u != (flags & ~O_NONBLOCK))
+    {
+        LOG("Unknown open flags.");
+    }
+    else if (NULL == (mqPtr = GetMessageQueue(queueId)))
+    {
+        LOG("Queue does not exist.");
+        fd = -ENOENT;
+    }
+    else
+    {
+        /* On success the file takes over the lookup reference. */
+        fd = anon_inode_getfd("[msgqueue]", &MessageQueueFops, mqPtr, O_RDWR | O_CLOEXEC | flags);
+        if (fd < 0)
         {
-            mqPtr = np->mqPtr;
-            break;
+            LOG("Could not create queue file.");
+            PutMessageQueue(mqPtr);
         }
     }
-    
-    return mqPtr;
+
+    LOG("Exiting msg_open system call.");
+
+    return fd;
 }
 
-SYSCALL_DEFINE1(create_queue, unsigned int, queueId)
+/*
+ * Sleeps on or wakes the peer of a shared ring. The wait operations return
+ * once the producer (MQ_RING_WAIT_DATA) or consumer (MQ_RING_WAIT_SPACE)
+ * index differs from value, so an index published between the caller's own
+ * check and the call is never missed.
+ */
+SYSCALL_DEFINE3(msg_ring_notify, unsigned int, queueId, unsigned int, op, unsigned int, value)
 {
-    LOG("Entering create_queue system call.");
+    LOG("Entering msg_ring_notify system call.");
+
+    int status = -ENOENT;
 
-    int status = E_NOK;
+    MessageQueue * mqPtr = GetMessageQueue(queueId);
 
-    if (E_NOK == FindMessageQueue(queueId))
+    if (mqPtr == NULL)
     {
-        LOG("Creating new message queue.");
-        MessageQueue * mqPtr = (MessageQueue*)kmalloc(sizeof(MessageQueue), GFP_ATOMIC);
-        if (mqPtr != NULL)
+        LOG("Queue does not exist.");
+    }
+    else if (mqPtr->ring == NULL)
+    {
+        LOG("Queue has no shared ring.");
+        status = -EINVAL;
+        PutMessageQueue(mqPtr);
+    }
+    else
+    {
+        struct MessageRingHeader * ring = mqPtr->ring;
+
+        switch (op)
         {
-            mutex_init(&mqPtr->receiveLock); 
-            mutex_init(&mqPtr->ackLock);
-            mutex_init(&mqPtr->queueLock);
+            case MQ_RING_WAIT_DATA:
+                LOG("Waiting for the producer.");
+                status = WaitOnRingIndex(mqPtr, &mqPtr->receiveWait, &ring->producer, &ring->consumerWaiters, value, NULL);
+                if ((E_OK == status) && READ_ONCE(mqPtr->dead))
+                {
+                    status = -EIDRM;
+                }
+                break;
 
-            LOG("Trying receiveLock.");
-            mutex_lock(&mqPtr->receiveLock);
-            LOG("Got receiveLock.");
-            
-            LOG("Trying ackLock.");
-            mutex_lock(&mqPtr->ackLock);
-            LOG("Got ackLock.");
+            case MQ_RING_WAIT_SPACE:
+                LOG("Waiting for the consumer.");
+                status = WaitOnRingIndex(mqPtr, &mqPtr->sendWait, &ring->consumer, &ring->producerWaiters, value, NULL);
+                if ((E_OK == status) && READ_ONCE(mqPtr->dead))
+                {
+                    status = -EIDRM;
+                }
+                break;
 
-            AddMessageQueue(queueId, mqPtr);
+            case MQ_RING_WAKE_CONSUMER:
+                wake_up_interruptible(&mqPtr->receiveWait);
+                status = E_OK;
+                break;
 
-            status = E_OK;
+            case MQ_RING_WAKE_PRODUCER:
+                wake_up_interruptible(&mqPtr->sendWait);
+                status = E_OK;
+                break;
+
+            default:
+                LOG("Unknown ring operation.");
+                status = -EINVAL;
+                break;
         }
+
+        PutMessageQueue(mqPtr);
+    }
+
+    LOG("Exiting msg_ring_notify system call.");
+
+    return status;
+}
+
+/*
+ * Reads or changes per-queue settings. arg is a value for the SET commands
+ * and a pointer to an unsigned int for the GET commands. The window does not
+ * apply to shared ring or sharded queues.
+ */
+SYSCALL_DEFINE3(msg_queue_ctl, unsigned int, queueId, unsigned int, cmd, unsigned long, arg)
+{
+    LOG("Entering msg_queue_ctl system call.");
+
+    int status = -ENOENT;
+
+    MessageQueue * mqPtr = GetMessageQueue(queueId);
+
+    if (mqPtr == NULL)
+    {
+        LOG("Queue does not exist.");
     }
     else
     {
-        LOG("Message queue already exists.");
-        status = E_OK;
+        status = -EINVAL;
+
+        switch (cmd)
+        {
+            case MQ_CTL_SET_WINDOW:
+                if (mqPtr->slots == NULL)
+                {
+                    LOG("Shared ring and sharded queues have no window.");
+                    break;
+                }
+                if ((0u == arg) || (arg > mqPtr->depth))
+                {
+                    LOG("Window must be between 1 and the queue depth.");
+                    break;
+                }
+
+                LockQueue(mqPtr);
+                WRITE_ONCE(mqPtr->window, (unsigned int)arg);
+                spin_unlock(&mqPtr->queueLock);
+
+                /* A larger window may unblock several senders at once. */
+                wake_up_interruptible_all(&mqPtr->sendWait);
+                status = E_OK;
+                break;
+
+            case MQ_CTL_GET_WINDOW:
+                if (mqPtr->slots == NULL)
+                {
+                    LOG("Shared ring and sharded queues have no window.");
+                    break;
+                }
+                status = put_user(READ_ONCE(mqPtr->window), (unsigned int __user *)arg);
+                break;
+
+            case MQ_CTL_SET_NONBLOCK:
+                /* Tasks already asleep keep waiting; only new calls see the change. */
+                WRITE_ONCE(mqPtr->nonblock, (0ul != arg));
+                status = E_OK;
+                break;
+
+            case MQ_CTL_GET_NONBLOCK:
+                status = put_user((unsigned int)READ_ONCE(mqPtr->nonblock), (unsigned int __user *)arg);
+                break;
+
+            case MQ_CTL_SET_LATENCY:
+                if (mqPtr->ring != NULL)
+                {
+                    LOG("Shared ring messages carry no timestamp.");
+                    break;
+                }
+                if ((0ul != arg) && (mqPtr->latency == NULL))
+                {
+                    /* Histograms are kept, and keep their counts, until the queue is freed. */
+                    struct MessageLatency __percpu * latency = alloc_percpu(struct MessageLatency);
+
+                    if (latency == NULL)
+                    {
+                        status = -ENOMEM;
+                        break;
+                    }
+
+                    LockQueue(mqPtr);
+                    if (mqPtr->latency == NULL)
+                    {
+                        mqPtr->latency = latency;
+                        latency = NULL;
+                    }
+                    spin_unlock(&mqPtr->queueLock);
+
+                    free_percpu(latency);
+                }
+
+                /* Pairs with the acquire in LatencyOf(). */
+                smp_store_release(&mqPtr->latencyOn, (0ul != arg));
+                status = E_OK;
+                break;
+
+            case MQ_CTL_GET_LATENCY:
+                status = put_user((unsigned int)READ_ONCE(mqPtr->latencyOn), (unsigned int __user *)arg);
+                break;
+
+            default:
+                LOG("Unknown control command.");
+                break;
+        }
+
+        PutMessageQueue(mqPtr);
     }
 
-    LOG("Exiting create_queue system call.");
+    LOG("Exiting msg_queue_ctl system call.");
 
     return status;
 }
 
-SYSCALL_DEFINE1(delete_queue, unsigned int, queueId)
+/*
+ * msg_send with a priority and an absolute CLOCK_REALTIME deadline, taking
+ * the same arguments as mq_timedsend. Messages of higher priority are
+ * received first. A NULL abs_timeout blocks like msg_send and a zero one
+ * never blocks. Returns -ETIMEDOUT if the message could not be queued before
+ * the deadline.
+ */
+SYSCALL_DEFINE5(msg_send_timed, unsigned int, queueId, char *, message, unsigned int, length, unsigned int, priority, const struct __kernel_timespec __user *, abs_timeout)
 {
-    LOG("Entering delete_queue system call.");
+    LOG("Entering msg_send_timed system call.");
 
-    int status = E_NOK;
+    int status;
+    ktime_t deadline;
+
+    MessageQueue * mqPtr = NULL;
 
-    if (E_NOK != FindMessageQueue(queueId))
+    if (E_OK != (status = GetDeadline(abs_timeout, &deadline)))
     {
-        MessageQueue * mqPtr = GetMessageQueue(queueId);
+        LOG("Invalid deadline.");
+    }
+    else if (NULL == (mqPtr = GetMessageQueue(queueId)))
+    {
+        LOG("Queue does not exist.");
+        status = -ENOENT;
+    }
+    else
+    {
+        status = SendMessage(mqPtr, message, length, priority, (abs_timeout != NULL) ? &deadline : NULL);
 
-        /* globalLock is needed here because queueLock will not be available after kfree is called.*/
-        mutex_lock(&globalLock);
+        PutMessageQueue(mqPtr);
+    }
 
-        LOG("Deleting message buffer.");
-        kfree(mqPtr->buffer);
-        
-        LOG("Unlocking receiveLock.");
-        mutex_unlock(&mqPtr->receiveLock);
+    LOG("Exiting msg_send_timed system call.");
 
-        LOG("Unlocking ackLock.");
-        mutex_unlock(&mqPtr->ackLock);
+    return status;
+}
 
-        LOG("Unlocking queueLock.");
-        mutex_unlock(&mqPtr->queueLock);
-        
-        mutex_unlock(&globalLock);
+/*
+ * msg_receive with an absolute CLOCK_REALTIME deadline, taking the same
+ * arguments as mq_timedreceive plus the length pointer. The message's
+ * priority is stored to priority unless it is NULL. A NULL abs_timeout
+ * blocks like msg_receive and a zero one never blocks. Returns -ETIMEDOUT if
+ * no message arrived before the deadline.
+ */
+SYSCALL_DEFINE5(msg_receive_timed, unsigned int, queueId, char *, buffer, unsigned int *, length, unsigned int *, priority, const struct __kernel_timespec __user *, abs_timeout)
+{
+    LOG("Entering msg_receive_timed system call.");
 
-        LOG("Deleting queue.");
-        kfree(mqPtr);
+    int status;
+    ktime_t deadline;
 
-        RemoveMessageQueue(queueId);
+    MessageQueue * mqPtr = NULL;
 
-        status = E_OK;
+    if (E_OK != (status = GetDeadline(abs_timeout, &deadline)))
+    {
+        LOG("Invalid deadline.");
     }
-    else
+    else if (NULL == (mqPtr = GetMessageQueue(queueId)))
     {
         LOG("Queue does not exist.");
+        status = -ENOENT;
+    }
+    else
+    {
+        struct MessageInfo info;
+
+        status = PutMessageInfo(ReceiveMessage(mqPtr, buffer, SIZE_MAX, &info, (abs_timeout != NULL) ? &deadline : NULL, false),
+                                &info, length, priority);
+
+        PutMessageQueue(mqPtr);
     }
 
-    LOG("Exiting delete_queue system call.");
-    
+    LOG("Exiting msg_receive_timed system call.");
+
     return status;
 }
 
-SYSCALL_DEFINE3(msg_send, unsigned int, queueId, char *, message, unsigned int, length)
+/* Slots record the global tgid; report it as the receiver's namespace sees it. */
+static pid_t VisibleTgid(pid_t tgid)
 {
-    LOG("Entering msg_send system call.");
+    pid_t nr = 0;
 
-    int status = E_NOK;
-
-    if (E_NOK != FindMessageQueue(queueId))
+    if (tgid != 0)
     {
-        MessageQueue * mqPtr = GetMessageQueue(queueId);
+        rcu_read_lock();
+        nr = pid_nr_ns(find_pid_ns(tgid, &init_pid_ns), task_active_pid_ns(current));
+        rcu_read_unlock();
+    }
 
-        mutex_lock(&mqPtr->queueLock);
+    return nr;
+}
 
-        LOG("Creating message buffer.");
-        mqPtr->buffer = (char*)kmalloc(length * sizeof(char), GFP_ATOMIC);
-        if (mqPtr->buffer != NULL)
-        {
-            LOG("Copying message from user space to kernel space.");
-            if (0u != copy_from_user(mqPtr->buffer, message, length))
-            {
-                LOG("User space to kernel space copy failed.");
-                LOG("Releasing receiveLock.");
-                mutex_unlock(&mqPtr->receiveLock);
-            }
-            else
-            {
-                mqPtr->len = length;
+/*
+ * msg_receive_timed that also returns the message's enqueue time, send
+ * order sequence number, msg_ack sequence number, sender tgid and shard in
+ * info. capacity bounds the copy into buffer; a larger message stays queued
+ * and -EMSGSIZE is returned. Returns E_OK or a negative errno.
+ */
+SYSCALL_DEFINE5(msg_receive_ext, unsigned int, queueId, char *, buffer, unsigned int, capacity, struct MessageInfo *, info, const struct __kernel_timespec __user *, abs_timeout)
+{
+    LOG("Entering msg_receive_ext system call.");
+
+    int status;
+    ktime_t deadline;
+    struct MessageInfo result;
 
-                LOG("Releasing receiveLock.");
-                mutex_unlock(&mqPtr->receiveLock);
+    MessageQueue * mqPtr = NULL;
 
-                LOG("Trying ackLock.");
-                mutex_lock(&mqPtr->ackLock);
-                LOG("Got ackLock.");
+    if (E_OK != (status = GetDeadline(abs_timeout, &deadline)))
+    {
+        LOG("Invalid deadline.");
+    }
+    else if (NULL == (mqPtr = GetMessageQueue(queueId)))
+    {
+        LOG("Queue does not exist.");
+        status = -ENOENT;
+    }
+    else
+    {
+        status = ReceiveMessage(mqPtr, buffer, capacity, &result, (abs_timeout != NULL) ? &deadline : NULL, false);
 
-                LOG("Deleting message buffer.");
-                kfree(mqPtr->buffer);
+        PutMessageQueue(mqPtr);
+    }
 
-                status = E_OK;
-            }
+    if (status >= 0)
+    {
+        result.tgid = VisibleTgid(result.tgid);
+        if (0u != copy_to_user(info, &result, sizeof(result)))
+        {
+            LOG("Copying from kernel space to user space failed.");
+            status = -EFAULT;
         }
         else
         {
-            LOG("Could not create message buffer.");
+            status = E_OK;
         }
+    }
+
+    LOG("Exiting msg_receive_ext system call.");
+
+    return status;
+}
+
+static int CreateQueueSet(unsigned int setId)
+{
+    struct QueueSet * set = kzalloc(sizeof(*set), GFP_KERNEL);
+    int status;
 
-        mutex_unlock(&mqPtr->queueLock);
+    if (set == NULL)
+    {
+        return -ENOMEM;
     }
-    else
+
+    set->id = setId;
+    spin_lock_init(&set->lock);
+    INIT_LIST_HEAD(&set->ready);
+    INIT_LIST_HEAD(&set->members);
+    init_waitqueue_head(&set->wait);
+    refcount_set(&set->refs, 1);
+
+    status = rhashtable_lookup_insert_fast(&setRegistry, &set->node, setRegistryParams);
+    if (0 != status)
     {
-        LOG("Queue does not exist.");
+        kfree(set);
     }
 
-    LOG("Exiting msg_send system call.");
-    
     return status;
 }
 
-SYSCALL_DEFINE3(msg_receive, unsigned int, queueId, char *, buffer, unsigned int *, length)
+/* Unpublishes set, detaches every member and wakes all waiters. */
+static void DestroyQueueSet(struct QueueSet * set)
 {
-    LOG("Entering msg_receive system call.");
+    MessageQueue * mqPtr;
+
+    if (0 != rhashtable_remove_fast(&setRegistry, &set->node, setRegistryParams))
+    {
+        /* Another destroy got there first. */
+        return;
+    }
 
-    int status = E_NOK;
+    WRITE_ONCE(set->dead, true);
+    wake_up_interruptible_all(&set->wait);
 
-    if (E_NOK != FindMessageQueue(queueId))
+    for (;;)
     {
-        MessageQueue * mqPtr = GetMessageQueue(queueId);
+        LockSet(set);
+        mqPtr = list_first_entry_or_null(&set->members, MessageQueue, setNode);
+        if (mqPtr != NULL)
+        {
+            refcount_inc(&mqPtr->refs);
+        }
+        spin_unlock(&set->lock);
+
+        if (mqPtr == NULL)
+        {
+            break;
+        }
+
+        LockQueue(mqPtr);
+        DetachFromSet(mqPtr, set);
+        spin_unlock(&mqPtr->queueLock);
+
+        PutMessageQueue(mqPtr);
+    }
+
+    /* Drop the registry's reference. */
+    PutQueueSet(set);
+}
 
-        mutex_lock(&mqPtr->queueLock);
+/*
+ * Creates or destroys queue set setId, or adds or removes queue queueId as
+ * a member. Shared ring and sharded queues cannot join a set.
+ */
+SYSCALL_DEFINE3(queue_set_ctl, unsigned int, setId, unsigned int, cmd, unsigned int, queueId)
+{
+    LOG("Entering queue_set_ctl system call.");
 
-        LOG("Trying receiveLock.");
-        mutex_lock(&mqPtr->receiveLock);
-        LOG("Got receiveLock.");
+    int status = -ENOENT;
+    struct QueueSet * set;
+    MessageQueue * mqPtr;
 
-        LOG("Copying message from kernel space to user space.");
-        if (0u != copy_to_user(buffer, mqPtr->buffer, mqPtr->len))
+    if (MQ_SET_CREATE == cmd)
+    {
+        LOG("Creating queue set.");
+        status = CreateQueueSet(setId);
+    }
+    else if ((MQ_SET_DESTROY != cmd) && (MQ_SET_ADD != cmd) && (MQ_SET_REMOVE != cmd))
+    {
+        LOG("Unknown queue set command.");
+        status = -EINVAL;
+    }
+    else if (NULL == (set = GetQueueSet(setId)))
+    {
+        LOG("Queue set does not exist.");
+    }
+    else
+    {
+        if (MQ_SET_DESTROY == cmd)
         {
-            LOG("Copying from kernel space to user space failed.");
+            LOG("Destroying queue set.");
+            DestroyQueueSet(set);
+            status = E_OK;
+        }
+        else if (NULL == (mqPtr = GetMessageQueue(queueId)))
+        {
+            LOG("Queue does not exist.");
         }
         else
         {
-            LOG("Copying message length from kernel space to user space.");
-            if (0u != copy_to_user(length, &mqPtr->len, sizeof(mqPtr->len)))
+            LockQueue(mqPtr);
+
+            if (MQ_SET_REMOVE == cmd)
             {
-                LOG("Copying from kernel space to user space failed.");
+                status = -EINVAL;
+                if (mqPtr->set == set)
+                {
+                    LOG("Removing queue from set.");
+                    DetachFromSet(mqPtr, set);
+                    status = E_OK;
+                }
+            }
+            else if ((mqPtr->slots == NULL) || (mqPtr->set != NULL))
+            {
+                LOG("Queue is a shared ring, sharded or already in a set.");
+                status = (mqPtr->set != NULL) ? -EBUSY : -EINVAL;
+            }
+            else if (mqPtr->dead || READ_ONCE(set->dead))
+            {
+                status = -EIDRM;
             }
             else
             {
-                LOG("Copying successful.");
+                LOG("Adding queue to set.");
+                refcount_inc(&mqPtr->refs);
+                refcount_inc(&set->refs);
+
+                LockSet(set);
+                list_add_tail(&mqPtr->setNode, &set->members);
+                spin_unlock(&set->lock);
+                mqPtr->set = set;
+
+                /* Messages queued before joining must be found too. */
+                if (!RingEmpty(mqPtr))
+                {
+                    MarkReady(mqPtr);
+                }
                 status = E_OK;
             }
+
+            spin_unlock(&mqPtr->queueLock);
+
+            PutMessageQueue(mqPtr);
         }
 
-        mutex_unlock(&mqPtr->queueLock);
-    }
-    else
-    {
-        LOG("Queue does not exist.");
+        PutQueueSet(set);
     }
 
-    LOG("Exiting msg_receive system call.");
-    
+    LOG("Exiting queue_set_ctl system call.");
+
     return status;
 }
 
-SYSCALL_DEFINE1(msg_ack, unsigned int, queueId)
+/*
+ * Receives the next message from any queue in set setId, blocking while no
+ * member has one. The source queue's id is stored to queueId; the message is
+ * acknowledged on that queue with msg_ack as usual. A queue that still has
+ * messages afterwards goes to the back of the ready list, so busy members
+ * are served round robin.
+ */
+SYSCALL_DEFINE4(msg_receive_any, unsigned int, setId, char *, buffer, unsigned int *, length, unsigned int *, queueId)
 {
-    LOG("Entering msg_ack system call.");
-
-    int status = E_NOK;
+    LOG("Entering msg_receive_any system call.");
 
-    if (E_NOK != FindMessageQueue(queueId))
-    {
-        MessageQueue * mqPtr = GetMessageQueue(queueId);
+    int status = -ENOENT;
+    ktime_t noWait = 0;
+    MessageQueue * mqPtr;
+    struct MessageInfo info;
 
-        LOG("Releasing ackLock.");
-    
-        mutex_lock(&mqPtr->queueLock);
-        mutex_unlock(&mqPtr->ackLock);
-        mutex_unlock(&mqPtr->queueLock);
+    struct QueueSet * set = GetQueueSet(setId);
 
-        status = E_OK;
+    if (set == NULL)
+    {
+        LOG("Queue set does not exist.");
     }
     else
     {
-        LOG("Queue does not exist.");
+        do
+        {
+            LockSet(set);
+            mqPtr = list_first_entry_or_null(&set->ready, MessageQueue, readyNode);
+            if (mqPtr != NULL)
+            {
+                list_del_init(&mqPtr->readyNode);
+                refcount_inc(&mqPtr->refs);
+            }
+            spin_unlock(&set->lock);
+
+            if (mqPtr == NULL)
+            {
+                if (READ_ONCE(set->dead))
+                {
+                    status = -EIDRM;
+                    break;
+                }
+
+                LOG("Waiting for a ready queue.");
+                if (0 != wait_event_interruptible_exclusive(set->wait, !list_empty_careful(&set->ready) || READ_ONCE(set->dead)))
+                {
+                    /* Pass on a wakeup we may have consumed. */
+                    if (!list_empty_careful(&set->ready))
+                    {
+                        wake_up_interruptible(&set->wait);
+                    }
+                    status = -ERESTARTSYS;
+                    break;
+                }
+
+                status = -EAGAIN;
+                continue;
+            }
+
+            /* Report the source first so a fault cannot lose the message. */
+            status = put_user(mqPtr->id, queueId);
+            if (E_OK == status)
+            {
+                /* The queue may have been drained by a direct msg_receive meanwhile. */
+                status = PutMessageInfo(ReceiveMessage(mqPtr, buffer, SIZE_MAX, &info, &noWait, false), &info, length, NULL);
+
+                /* A member deleted under us just means trying the next one. */
+                if (-EIDRM == status)
+                {
+                    status = -EAGAIN;
+                }
+            }
+
+            LockQueue(mqPtr);
+            if (!RingEmpty(mqPtr))
+            {
+                MarkReady(mqPtr);
+            }
+            spin_unlock(&mqPtr->queueLock);
+
+            PutMessageQueue(mqPtr);
+        } while (-EAGAIN == status);
+
+        PutQueueSet(set);
     }
 
-    LOG("Exiting msg_ack system call.");
+    LOG("Exiting msg_receive_any system call.");
 
     return status;
-}
\ No newline at end of file
+}
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM messagequeue
+
+#if !defined(_MESSAGEQUEUE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MESSAGEQUEUE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(mq_create,
+
+    TP_PROTO(unsigned int queueId, unsigned int depth, unsigned int flags),
+
+    TP_ARGS(queueId, depth, flags),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, queueId)
+        __field(unsigned int, depth)
+        __field(unsigned int, flags)
+    ),
+
+    TP_fast_assign(
+        __entry->queueId = queueId;
+        __entry->depth = depth;
+        __entry->flags = flags;
+    ),
+
+    TP_printk("queue=%u depth=%u flags=0x%x", __entry->queueId, __entry->depth, __entry->flags)
+);
+
+TRACE_EVENT(mq_delete,
+
+    TP_PROTO(unsigned int queueId),
+
+    TP_ARGS(queueId),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, queueId)
+    ),
+
+    TP_fast_assign(
+        __entry->queueId = queueId;
+    ),
+
+    TP_printk("queue=%u", __entry->queueId)
+);
+
+/* msg_send entry, before the message is copied in. */
+TRACE_EVENT(mq_send,
+
+    TP_PROTO(unsigned int queueId, unsigned int length),
+
+    TP_ARGS(queueId, length),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, queueId)
+        __field(unsigned int, length)
+    ),
+
+    TP_fast_assign(
+        __entry->queueId = queueId;
+        __entry->length = length;
+    ),
+
+    TP_printk("queue=%u len=%u", __entry->queueId, __entry->length)
+);
+
+/*
+ * The message has been placed in the ring and is visible to receivers. seq
+ * is the send order number msg_receive_ext reports, so an enqueue and its
+ * receive carry the same one.
+ */
+TRACE_EVENT(mq_enqueue,
+
+    TP_PROTO(unsigned int queueId, unsigned long seq, unsigned int length, unsigned int priority, u64 enqueueTime),
+
+    TP_ARGS(queueId, seq, length, priority, enqueueTime),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, queueId)
+        __field(unsigned long, seq)
+        __field(unsigned int, length)
+        __field(unsigned int, priority)
+        __field(u64, enqueueTime)
+    ),
+
+    TP_fast_assign(
+        __entry->queueId = queueId;
+        __entry->seq = seq;
+        __entry->length = length;
+        __entry->priority = priority;
+        __entry->enqueueTime = enqueueTime;
+    ),
+
+    TP_printk("queue=%u seq=%lu len=%u prio=%u enqueued=%llu", __entry->queueId, __entry->seq,
+              __entry->length, __entry->priority, __entry->enqueueTime)
+);
+
+/* latency is the time the message spent queued, in nanoseconds; seq is as for mq_enqueue. */
+TRACE_EVENT(mq_receive,
+
+    TP_PROTO(unsigned int queueId, unsigned long seq, unsigned int length, u64 enqueueTime),
+
+    TP_ARGS(queueId, seq, length, enqueueTime),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, queueId)
+        __field(unsigned long, seq)
+        __field(unsigned int, length)
+        __field(u64, enqueueTime)
+        __field(u64, latency)
+    ),
+
+    TP_fast_assign(
+        __entry->queueId = queueId;
+        __entry->seq = seq;
+        __entry->length = length;
+        __entry->enqueueTime = enqueueTime;
+        __entry->latency = ktime_get_ns() - enqueueTime;
+    ),
+
+    TP_printk("queue=%u seq=%lu len=%u enqueued=%llu latency=%llu", __entry->queueId, __entry->seq,
+              __entry->length, __entry->enqueueTime, __entry->latency)
+);
+
+/* seq is the receive order number msg_ack takes, not the one above. */
+TRACE_EVENT(mq_ack,
+
+    TP_PROTO(unsigned int queueId, unsigned long seq),
+
+    TP_ARGS(queueId, seq),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, queueId)
+        __field(unsigned long, seq)
+    ),
+
+    TP_fast_assign(
+        __entry->queueId = queueId;
+        __entry->seq = seq;
+    ),
+
+    TP_printk("queue=%u seq=%lu", __entry->queueId, __entry->seq)
+);
+
+#endif /* _MESSAGEQUEUE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE messagequeue_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,96 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+
+#define E_OK 0x0
+#define E_NOK 0xFF
+
+/* Queue ids used by the benchmark start here to stay clear of the test apps. */
+#define BENCH_QUEUE_BASE 0x10000000u
+#define BENCH_LOOKUPS 1000000u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_ack_syscall(unsigned int queueId)
+{
+ return syscall(__NR_msg_ack, queueId, 0ul);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * Measures the registry lookup cost while the number of live queues grows
+ * from 10 to 1,000,000. msg_ack on a queue with nothing received is used as
+ * the probe: it does one lookup and no copying, so the per-call time is the
+ * syscall entry plus the lookup.
+ */
+int main(int argc, char *argv[])
+{
+    unsigned int sizes[] = {10u, 100u, 1000u, 10000u, 100000u, 1000000u};
+    unsigned int created = 0u;
+    unsigned int i;
+    unsigned int n;
+
+    srand(1u);
+
+    printf("queues,lookups,ns_per_lookup\n");
+
+    for (n = 0u; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    {
+        while (created < sizes[n])
+        {
+            /* Depth 1 keeps the memory footprint of a million queues small. */
+            if (E_OK != create_queue_syscall(BENCH_QUEUE_BASE + created, 1u, 0u))
+            {
+                LOG("create_queue system call returned error.");
+                goto cleanup;
+            }
+            created++;
+        }
+
+        double start = now_ns();
+        for (i = 0u; i < BENCH_LOOKUPS; i++)
+        {
+            msg_ack_syscall(BENCH_QUEUE_BASE + ((unsigned int)rand() % created));
+        }
+        double elapsed = now_ns() - start;
+
+        printf("%u,%u,%.1f\n", created, BENCH_LOOKUPS, elapsed / BENCH_LOOKUPS);
+        fflush(stdout);
+    }
+
+cleanup:
+    LOG("Deleting queues.");
+    for (i = 0u; i < created; i++)
+    {
+        delete_queue_syscall(BENCH_QUEUE_BASE + i);
+    }
+
+    return 0;
+}
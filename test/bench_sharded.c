@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_open 470
+
+#define E_OK 0x0
+
+#define MQ_FLAG_SHARDED 0x8u
+#define MQ_FLAG_ORDERED 0x10u
+
+/* Queue id used by the benchmark; stays clear of the test apps. */
+#define BENCH_QUEUE_ID 0x20000000u
+#define BENCH_DEPTH 256u
+#define MESSAGES_PER_PRODUCER 200000u
+#define MESSAGE_SIZE 64u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_open_syscall(unsigned int queueId, unsigned int flags)
+{
+ return syscall(__NR_msg_open, queueId, flags);
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void pin(unsigned int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+/*
+ * Runs consumers pinned to the first CPUs and producers pinned to the ones
+ * after them. The consumers split the messages between them.
+ */
+static double run(unsigned int producers, unsigned int consumers, unsigned int flags)
+{
+    char message[MESSAGE_SIZE] = "payload";
+    unsigned long total = (unsigned long)producers * MESSAGES_PER_PRODUCER;
+    unsigned int i;
+    int fd;
+
+    if (E_OK != create_queue_syscall(BENCH_QUEUE_ID, BENCH_DEPTH, flags))
+    {
+        perror("create_queue");
+        exit(1);
+    }
+
+    fd = (int)msg_open_syscall(BENCH_QUEUE_ID, 0u);
+    if (fd < 0)
+    {
+        perror("msg_open");
+        exit(1);
+    }
+
+    double start = now_s();
+
+    for (i = 0u; i < consumers; i++)
+    {
+        if (0 == fork())
+        {
+            unsigned long quota = total / consumers + ((0u == i) ? total % consumers : 0ul);
+            unsigned long received;
+
+            pin(i);
+            for (received = 0ul; received < quota; received++)
+            {
+                if (read(fd, message, sizeof(message)) < 0)
+                {
+                    perror("read");
+                    exit(1);
+                }
+            }
+            exit(0);
+        }
+    }
+
+    for (i = 0u; i < producers; i++)
+    {
+        if (0 == fork())
+        {
+            unsigned int n;
+
+            pin(consumers + i);
+            for (n = 0u; n < MESSAGES_PER_PRODUCER; n++)
+            {
+                if (write(fd, message, sizeof(message)) < 0)
+                {
+                    perror("write");
+                    exit(1);
+                }
+            }
+            exit(0);
+        }
+    }
+
+    while (wait(NULL) > 0)
+    {
+    }
+
+    double elapsed = now_s() - start;
+
+    close(fd);
+    delete_queue_syscall(BENCH_QUEUE_ID);
+
+    return (double)total / elapsed;
+}
+
+/*
+ * Usage: bench_sharded [consumers]. Compares fan-in throughput of a plain
+ * queue against per-CPU sharded queues (unordered and ordered) in
+ * messages/s as the number of producer cores grows. Outputs CSV.
+ */
+int main(int argc, char *argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int consumers = (argc > 1) ? (unsigned int)atoi(argv[1]) : 1u;
+    unsigned int producers;
+
+    if ((0u == consumers) || (consumers >= (unsigned int)cpus))
+    {
+        LOG("Need at least one consumer and one CPU left for producers.");
+        return -1;
+    }
+
+    printf("producers,plain,sharded,sharded_ordered\n");
+
+    for (producers = 1u; (consumers + producers) <= (unsigned int)cpus; producers *= 2u)
+    {
+        double plain = run(producers, consumers, 0u);
+        double sharded = run(producers, consumers, MQ_FLAG_SHARDED);
+        double ordered = run(producers, consumers, MQ_FLAG_SHARDED | MQ_FLAG_ORDERED);
+
+        printf("%u,%.0f,%.0f,%.0f\n", producers, plain, sharded, ordered);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,621 @@
+#define _GNU_SOURCE
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+#define __NR_msg_receive_ext 477
+
+#define E_OK 0x0
+
+/* Queue ids used by the suite start here to stay clear of the other apps. */
+#define BENCH_QUEUE_BASE 0x20000000u
+#define BENCH_DEPTH 256u
+#define BENCH_PROCS_MAX 64u
+
+#define LOG(m) fprintf(stderr, "%s: %d : %s\n", __FILE__, __LINE__, m)
+
+struct MessageInfo
+{
+    __u64 enqueueTime;
+    __u64 sequence;
+    __u64 ackSequence;
+    __u32 length;
+    __u32 priority;
+    __s32 tgid;
+    __u32 shard;
+};
+
+/* One output row. Latencies are in nanoseconds. */
+struct Result
+{
+    const char *bench;
+    unsigned int bytes;
+    unsigned int senders;
+    unsigned int receivers;
+    unsigned int queues;
+    unsigned long messages;
+    double seconds;
+    unsigned long long p50;
+    unsigned long long p90;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long max;
+};
+
+/*
+ * State shared with the forked workers. samples has room for every message
+ * of one run; workers claim entries with nextSample.
+ */
+struct Shared
+{
+    volatile int go;
+    unsigned long nextSample;
+    unsigned long long samples[];
+};
+
+static int json = 0;
+static int pin = 1;
+static int rows = 0;
+static long cpus = 1;
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_send_syscall(unsigned int queueId, char *message, unsigned int length)
+{
+ return syscall(__NR_msg_send, queueId, message, length);
+}
+
+long msg_receive_syscall(unsigned int queueId, char *buffer, unsigned int *length)
+{
+ return syscall(__NR_msg_receive, queueId, buffer, length);
+}
+
+long msg_ack_syscall(unsigned int queueId, unsigned long sequence)
+{
+ return syscall(__NR_msg_ack, queueId, sequence);
+}
+
+long msg_receive_ext_syscall(unsigned int queueId, char *buffer, unsigned int capacity, struct MessageInfo *info, const struct timespec *absTimeout)
+{
+ return syscall(__NR_msg_receive_ext, queueId, buffer, capacity, info, absTimeout);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+/* Pins the calling process to one CPU, wrapping around on small machines. */
+static void pin_cpu(unsigned int index)
+{
+    cpu_set_t set;
+
+    if (!pin)
+    {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(index % (unsigned int)cpus, &set);
+    if (0 != sched_setaffinity(0, sizeof(set), &set))
+    {
+        LOG("sched_setaffinity failed, running unpinned.");
+    }
+}
+
+static struct Shared *map_shared(unsigned long samples)
+{
+    struct Shared *shared = mmap(NULL, sizeof(*shared) + samples * sizeof(shared->samples[0]),
+                                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    return (MAP_FAILED == shared) ? NULL : shared;
+}
+
+static void unmap_shared(struct Shared *shared, unsigned long samples)
+{
+    munmap(shared, sizeof(*shared) + samples * sizeof(shared->samples[0]));
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static unsigned long long percentile(const unsigned long long *sorted, unsigned long count, unsigned int permille)
+{
+    return sorted[((count - 1ul) * permille) / 1000ul];
+}
+
+/* Sorts samples and fills in the percentiles of result. */
+static void summarize(struct Result *result, unsigned long long *samples, unsigned long count)
+{
+    if (0ul == count)
+    {
+        return;
+    }
+
+    qsort(samples, count, sizeof(samples[0]), compare_samples);
+    result->p50 = percentile(samples, count, 500u);
+    result->p90 = percentile(samples, count, 900u);
+    result->p99 = percentile(samples, count, 990u);
+    result->p999 = percentile(samples, count, 999u);
+    result->max = samples[count - 1ul];
+}
+
+static void emit(const struct Result *result)
+{
+    double rate = (result->seconds > 0.0) ? (double)result->messages / result->seconds : 0.0;
+    double mbps = rate * (double)result->bytes / 1e6;
+
+    if (json)
+    {
+        printf("%s  {\"bench\": \"%s\", \"bytes\": %u, \"senders\": %u, \"receivers\": %u, \"queues\": %u, "
+               "\"messages\": %lu, \"seconds\": %.6f, \"msgs_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+               "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+               (0 == rows) ? "[\n" : ",\n", result->bench, result->bytes, result->senders, result->receivers,
+               result->queues, result->messages, result->seconds, rate, mbps,
+               result->p50, result->p90, result->p99, result->p999, result->max);
+    }
+    else
+    {
+        if (0 == rows)
+        {
+            printf("bench,bytes,senders,receivers,queues,messages,seconds,msgs_per_sec,mb_per_sec,"
+                   "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+        }
+        printf("%s,%u,%u,%u,%u,%lu,%.6f,%.1f,%.3f,%llu,%llu,%llu,%llu,%llu\n",
+               result->bench, result->bytes, result->senders, result->receivers, result->queues,
+               result->messages, result->seconds, rate, mbps,
+               result->p50, result->p90, result->p99, result->p999, result->max);
+    }
+    fflush(stdout);
+    rows++;
+}
+
+/*
+ * Ping-pong between two processes pinned to different CPUs. The parent
+ * stamps each request just before msg_send and the child stamps it as
+ * msg_receive returns, which gives the one-way latency; the parent's round
+ * trip covers the request, the echo and both acknowledgements.
+ */
+static int bench_pingpong(unsigned int size, unsigned long iterations)
+{
+    unsigned int request = BENCH_QUEUE_BASE;
+    unsigned int response = BENCH_QUEUE_BASE + 1u;
+    struct Result result = {0};
+    unsigned long long *sent = malloc(iterations * sizeof(*sent));
+    unsigned long long *roundTrip = malloc(iterations * sizeof(*roundTrip));
+    struct Shared *shared = map_shared(iterations);
+    char *buffer = calloc(1u, size + 1u);
+    unsigned int length;
+    unsigned long i;
+    int status = -1;
+    pid_t child;
+
+    if ((sent == NULL) || (roundTrip == NULL) || (shared == NULL) || (buffer == NULL))
+    {
+        LOG("Out of memory.");
+        goto out;
+    }
+
+    if ((E_OK != create_queue_syscall(request, 0u, 0u)) || (E_OK != create_queue_syscall(response, 0u, 0u)))
+    {
+        LOG("create_queue system call returned error.");
+        goto out;
+    }
+
+    child = fork();
+    if (0 == child)
+    {
+        pin_cpu(1u);
+        for (i = 0ul; i < iterations; i++)
+        {
+            if (E_OK != msg_receive_syscall(request, buffer, &length))
+            {
+                LOG("msg_receive system call returned error.");
+                _exit(1);
+            }
+            shared->samples[i] = now_ns();
+            msg_ack_syscall(request, 0ul);
+            msg_send_syscall(response, buffer, length);
+        }
+        _exit(0);
+    }
+
+    pin_cpu(0u);
+    unsigned long long start = now_ns();
+    for (i = 0ul; i < iterations; i++)
+    {
+        sent[i] = now_ns();
+        if ((E_OK != msg_send_syscall(request, buffer, size)) ||
+            (E_OK != msg_receive_syscall(response, buffer, &length)))
+        {
+            LOG("Round trip failed.");
+            break;
+        }
+        msg_ack_syscall(response, 0ul);
+        roundTrip[i] = now_ns() - sent[i];
+    }
+    unsigned long long elapsed = now_ns() - start;
+
+    if (i < iterations)
+    {
+        kill(child, SIGKILL);
+    }
+    waitpid(child, NULL, 0);
+
+    if (i == iterations)
+    {
+        for (i = 0ul; i < iterations; i++)
+        {
+            shared->samples[i] -= sent[i];
+        }
+
+        result.bytes = size;
+        result.senders = 1u;
+        result.receivers = 1u;
+        result.queues = 2u;
+        result.messages = iterations;
+        result.seconds = (double)elapsed / 1e9;
+
+        result.bench = "oneway";
+        summarize(&result, shared->samples, iterations);
+        emit(&result);
+
+        result.bench = "roundtrip";
+        summarize(&result, roundTrip, iterations);
+        emit(&result);
+        status = 0;
+    }
+
+    delete_queue_syscall(request);
+    delete_queue_syscall(response);
+
+out:
+    free(sent);
+    free(roundTrip);
+    free(buffer);
+    if (shared != NULL)
+    {
+        unmap_shared(shared, iterations);
+    }
+    return status;
+}
+
+static void throughput_sender(struct Shared *shared, unsigned int index, unsigned int size, unsigned long count)
+{
+    char *buffer = calloc(1u, size);
+    unsigned long i;
+
+    pin_cpu(index);
+    while (!shared->go)
+    {
+    }
+
+    for (i = 0ul; i < count; i++)
+    {
+        if (E_OK != msg_send_syscall(BENCH_QUEUE_BASE, buffer, size))
+        {
+            LOG("msg_send system call returned error.");
+            _exit(1);
+        }
+    }
+    _exit(0);
+}
+
+/* Receives until an empty message, recording how long each one was queued. */
+static void throughput_receiver(struct Shared *shared, unsigned int index, unsigned int size, unsigned long total)
+{
+    char *buffer = calloc(1u, size);
+    struct MessageInfo info;
+
+    pin_cpu(index);
+
+    for (;;)
+    {
+        if (E_OK != msg_receive_ext_syscall(BENCH_QUEUE_BASE, buffer, size, &info, NULL))
+        {
+            LOG("msg_receive_ext system call returned error.");
+            _exit(1);
+        }
+        unsigned long long received = now_ns();
+        /* With several receivers, acking the oldest message could release another receiver's. */
+        msg_ack_syscall(BENCH_QUEUE_BASE, (unsigned long)info.ackSequence);
+        if (0u == info.length)
+        {
+            break;
+        }
+
+        unsigned long slot = __atomic_fetch_add(&shared->nextSample, 1ul, __ATOMIC_RELAXED);
+        if (slot < total)
+        {
+            shared->samples[slot] = received - info.enqueueTime;
+        }
+    }
+    _exit(0);
+}
+
+/*
+ * senders processes each send count messages of size bytes to one queue
+ * drained by receivers processes, every process on its own CPU where there
+ * are enough. The percentiles are of the time messages spent queued, taken
+ * from the enqueue time msg_receive_ext reports.
+ */
+static int bench_throughput(unsigned int size, unsigned int senders, unsigned int receivers, unsigned long count)
+{
+    unsigned long total = count * senders;
+    struct Result result = {0};
+    struct Shared *shared = map_shared(total);
+    pid_t pids[2u * BENCH_PROCS_MAX];
+    unsigned int procs = 0u;
+    unsigned int i;
+    int status = 0;
+    int exitStatus;
+
+    if (shared == NULL)
+    {
+        LOG("Out of memory.");
+        return -1;
+    }
+
+    if (E_OK != create_queue_syscall(BENCH_QUEUE_BASE, BENCH_DEPTH, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        unmap_shared(shared, total);
+        return -1;
+    }
+
+    for (i = 0u; i < receivers; i++)
+    {
+        pids[procs] = fork();
+        if (0 == pids[procs])
+        {
+            throughput_receiver(shared, senders + i, size, total);
+        }
+        procs++;
+    }
+    for (i = 0u; i < senders; i++)
+    {
+        pids[procs] = fork();
+        if (0 == pids[procs])
+        {
+            throughput_sender(shared, i, size, count);
+        }
+        procs++;
+    }
+
+    unsigned long long start = now_ns();
+    shared->go = 1;
+
+    for (i = receivers; i < procs; i++)
+    {
+        waitpid(pids[i], &exitStatus, 0);
+        status |= exitStatus;
+    }
+
+    /* Empty messages queue up behind the data and stop one receiver each. */
+    for (i = 0u; i < receivers; i++)
+    {
+        msg_send_syscall(BENCH_QUEUE_BASE, "", 0u);
+    }
+    for (i = 0u; i < receivers; i++)
+    {
+        waitpid(pids[i], &exitStatus, 0);
+        status |= exitStatus;
+    }
+    unsigned long long elapsed = now_ns() - start;
+
+    delete_queue_syscall(BENCH_QUEUE_BASE);
+
+    if (0 == status)
+    {
+        result.bench = "throughput";
+        result.bytes = size;
+        result.senders = senders;
+        result.receivers = receivers;
+        result.queues = 1u;
+        result.messages = total;
+        result.seconds = (double)elapsed / 1e9;
+        summarize(&result, shared->samples, (shared->nextSample < total) ? shared->nextSample : total);
+        emit(&result);
+    }
+    else
+    {
+        LOG("A worker failed.");
+    }
+
+    unmap_shared(shared, total);
+    return (0 == status) ? 0 : -1;
+}
+
+/*
+ * Times a send, receive and acknowledgement on a random queue out of a
+ * growing number of live ones. The queue is always empty, so the time
+ * beyond a plain ping on one queue is the registry lookup and cache misses.
+ */
+static int bench_scaling(unsigned long iterations)
+{
+    unsigned int sizes[] = {1u, 10u, 100u, 1000u, 10000u, 100000u};
+    unsigned long long *samples = malloc(iterations * sizeof(*samples));
+    unsigned int created = 0u;
+    struct Result result = {0};
+    char buffer[64] = {0};
+    unsigned int length;
+    unsigned long i;
+    unsigned int n;
+    int status = 0;
+
+    if (samples == NULL)
+    {
+        LOG("Out of memory.");
+        return -1;
+    }
+
+    pin_cpu(0u);
+    srand(1u);
+
+    for (n = 0u; (n < sizeof(sizes) / sizeof(sizes[0])) && (0 == status); n++)
+    {
+        while (created < sizes[n])
+        {
+            /* Depth 1 keeps the memory footprint of many queues small. */
+            if (E_OK != create_queue_syscall(BENCH_QUEUE_BASE + created, 1u, 0u))
+            {
+                LOG("create_queue system call returned error.");
+                status = -1;
+                break;
+            }
+            created++;
+        }
+
+        unsigned long long start = now_ns();
+        for (i = 0ul; (i < iterations) && (0 == status); i++)
+        {
+            unsigned int queueId = BENCH_QUEUE_BASE + ((unsigned int)rand() % created);
+            unsigned long long begin = now_ns();
+
+            if ((E_OK != msg_send_syscall(queueId, buffer, sizeof(buffer))) ||
+                (E_OK != msg_receive_syscall(queueId, buffer, &length)) ||
+                (E_OK != msg_ack_syscall(queueId, 0ul)))
+            {
+                LOG("Send, receive or ack failed.");
+                status = -1;
+            }
+            samples[i] = now_ns() - begin;
+        }
+        unsigned long long elapsed = now_ns() - start;
+
+        if (0 == status)
+        {
+            result.bench = "scaling";
+            result.bytes = sizeof(buffer);
+            result.senders = 1u;
+            result.receivers = 1u;
+            result.queues = created;
+            result.messages = iterations;
+            result.seconds = (double)elapsed / 1e9;
+            summarize(&result, samples, iterations);
+            emit(&result);
+        }
+    }
+
+    for (i = 0ul; i < created; i++)
+    {
+        delete_queue_syscall(BENCH_QUEUE_BASE + (unsigned int)i);
+    }
+    free(samples);
+
+    return status;
+}
+
+/*
+ * Usage: bench_suite [-f csv|json] [-t all|pingpong|throughput|scaling]
+ *                    [-n iterations] [-u]
+ * Writes one row per measurement to stdout; -u leaves processes unpinned.
+ * Large messages use fewer iterations so a sweep finishes in reasonable
+ * time.
+ */
+int main(int argc, char *argv[])
+{
+    unsigned int sizes[] = {1u, 64u, 256u, 4096u, 65536u, 1048576u};
+    unsigned int shapes[][2] = {{1u, 1u}, {1u, 4u}, {4u, 1u}, {4u, 4u}};
+    const char *test = "all";
+    unsigned long iterations = 20000ul;
+    unsigned int s;
+    unsigned int k;
+    int status = 0;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "f:t:n:u")))
+    {
+        switch (opt)
+        {
+            case 'f':
+                json = (0 == strcmp(optarg, "json"));
+                break;
+            case 't':
+                test = optarg;
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                pin = 0;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f csv|json] [-t all|pingpong|throughput|scaling] [-n iterations] [-u]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (0ul == iterations)
+    {
+        iterations = 1ul;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+    {
+        cpus = 1;
+    }
+
+    if ((0 == strcmp(test, "all")) || (0 == strcmp(test, "pingpong")))
+    {
+        for (s = 0u; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            status |= bench_pingpong(sizes[s], (sizes[s] > 4096u) ? (iterations / 100ul) + 1ul : iterations);
+        }
+    }
+
+    if ((0 == strcmp(test, "all")) || (0 == strcmp(test, "throughput")))
+    {
+        for (k = 0u; k < sizeof(shapes) / sizeof(shapes[0]); k++)
+        {
+            for (s = 0u; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+            {
+                status |= bench_throughput(sizes[s], shapes[k][0], shapes[k][1],
+                                           (sizes[s] > 4096u) ? (iterations / 100ul) + 1ul : iterations);
+            }
+        }
+    }
+
+    if ((0 == strcmp(test, "all")) || (0 == strcmp(test, "scaling")))
+    {
+        status |= bench_scaling(iterations);
+    }
+
+    if (json)
+    {
+        printf("%s]\n", (0 == rows) ? "[" : "\n");
+    }
+
+    return (0 == status) ? 0 : 1;
+}
@@ -1,3 +1,5 @@
 gcc -o sender sender.c && gcc -o receiver receiver.c
 
-gcc -o create_queue create_queue.c && gcc -o delete_queue delete_queue.c && gcc -o send_message send_message.c && gcc -o receive_message receive_message.c && gcc -o ack ack.c
\ No newline at end of file
+gcc -o create_queue create_queue.c && gcc -o delete_queue delete_queue.c && gcc -o send_message send_message.c && gcc -o receive_message receive_message.c && gcc -o ack ack.c && gcc -o send_batch send_batch.c && gcc -o receive_batch receive_batch.c && gcc -o ring_transport ring_transport.c && gcc -o queue_ctl queue_ctl.c && gcc -o receive_timed receive_timed.c && gcc -o receive_nonblock receive_nonblock.c && gcc -o epoll_queues epoll_queues.c && gcc -o receive_any receive_any.c && gcc -o send_priority send_priority.c && gcc -o send_large send_large.c && gcc -o queue_stats queue_stats.c && gcc -o latency latency.c && gcc -o receive_ext receive_ext.c
+
+gcc -O2 -o bench_lookup bench_lookup.c && gcc -O2 -o mpmc mpmc.c && gcc -O2 -o bench_sharded bench_sharded.c && gcc -O2 -o pingpong pingpong.c && gcc -O2 -o bench_suite bench_suite.c
\ No newline at end of file
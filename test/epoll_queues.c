@@ -0,0 +1,120 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_msg_open 470
+
+#define E_OK 0x0
+
+#define MESSAGE_MAX 256
+#define QUEUE_BASE 16u
+#define QUEUE_COUNT 4u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_open_syscall(unsigned int queueId, unsigned int flags)
+{
+ return syscall(__NR_msg_open, queueId, flags);
+}
+
+/*
+ * Opens QUEUE_COUNT queues (ids 16..19), writes one message to each through
+ * its descriptor and then drains all of them from a single epoll loop.
+ */
+int main(int argc, char *argv[])
+{
+    char buffer[MESSAGE_MAX + 1];
+    struct epoll_event events[QUEUE_COUNT];
+    int fds[QUEUE_COUNT];
+    unsigned int received = 0u;
+    unsigned int i;
+    int epfd;
+
+    epfd = epoll_create1(0);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    for (i = 0u; i < QUEUE_COUNT; i++)
+    {
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = i};
+
+        if (E_OK != create_queue_syscall(QUEUE_BASE + i, 0u, 0u))
+        {
+            perror("create_queue");
+            return -1;
+        }
+
+        fds[i] = (int)msg_open_syscall(QUEUE_BASE + i, O_NONBLOCK);
+        if (fds[i] < 0)
+        {
+            perror("msg_open");
+            return -1;
+        }
+
+        snprintf(buffer, sizeof(buffer), "message for queue %u", QUEUE_BASE + i);
+        if (write(fds[i], buffer, strlen(buffer) + 1u) < 0)
+        {
+            perror("write");
+            return -1;
+        }
+
+        if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event))
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+
+    while (received < QUEUE_COUNT)
+    {
+        int ready = epoll_wait(epfd, events, QUEUE_COUNT, 1000);
+
+        if (ready <= 0)
+        {
+            LOG("epoll_wait timed out or failed.");
+            return -1;
+        }
+
+        for (i = 0u; i < (unsigned int)ready; i++)
+        {
+            ssize_t length;
+
+            /* Drain until the non-blocking descriptor reports EAGAIN. */
+            while ((length = read(fds[events[i].data.u32], buffer, MESSAGE_MAX)) >= 0)
+            {
+                buffer[length] = '\0';
+                printf(">>> Queue %u: %s\n", QUEUE_BASE + events[i].data.u32, buffer);
+                received++;
+            }
+
+            if (EAGAIN != errno)
+            {
+                perror("read");
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0u; i < QUEUE_COUNT; i++)
+    {
+        close(fds[i]);
+    }
+    close(epfd);
+
+    return 0;
+}
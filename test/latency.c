@@ -0,0 +1,172 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+#define __NR_msg_queue_ctl 472
+
+#define E_OK 0x0
+
+#define MQ_CTL_SET_LATENCY 5u
+
+#define QUEUE_ID 8u
+#define MESSAGE_MAX 256u
+#define MESSAGES 100000u
+#define BUCKETS 32u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_send_syscall(unsigned int queueId, char *message, unsigned int length)
+{
+ return syscall(__NR_msg_send, queueId, message, length);
+}
+
+long msg_receive_syscall(unsigned int queueId, char *buffer, unsigned int *length)
+{
+ return syscall(__NR_msg_receive, queueId, buffer, length);
+}
+
+long msg_ack_syscall(unsigned int queueId)
+{
+ return syscall(__NR_msg_ack, queueId, 0ul);
+}
+
+long msg_queue_ctl_syscall(unsigned int queueId, unsigned int cmd, unsigned long arg)
+{
+ return syscall(__NR_msg_queue_ctl, queueId, cmd, arg);
+}
+
+/* Prints the bucket bounds that hold the 50th, 99th and 99.9th percentiles. */
+static void print_percentiles(const char *name, const unsigned long long *counts)
+{
+    const double quantiles[] = {0.5, 0.99, 0.999};
+    unsigned long long total = 0ull;
+    unsigned long long seen;
+    unsigned int q;
+    unsigned int i;
+
+    for (i = 0u; i < BUCKETS; i++)
+    {
+        total += counts[i];
+    }
+
+    printf("%s: %llu messages", name, total);
+    for (q = 0u; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+    {
+        seen = 0ull;
+        for (i = 0u; i < BUCKETS; i++)
+        {
+            seen += counts[i];
+            if ((double)seen >= quantiles[q] * (double)total)
+            {
+                break;
+            }
+        }
+        printf(", p%g < %llu ns", quantiles[q] * 100.0, 2ull << ((i < BUCKETS) ? i : BUCKETS - 1u));
+    }
+    printf("\n");
+}
+
+/*
+ * Switches on the latency histograms of a queue, pushes MESSAGES through it
+ * to a child that receives and acknowledges each one, and prints percentiles
+ * read back from /proc/messagequeue/latency.
+ */
+int main(int argc, char *argv[])
+{
+    char buffer[MESSAGE_MAX] = {0};
+    char line[1024];
+    char name[16];
+    unsigned long long counts[BUCKETS];
+    unsigned int length = 0u;
+    unsigned int queueId;
+    unsigned int i;
+    FILE *file;
+    pid_t child;
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 64u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    if (E_OK != msg_queue_ctl_syscall(QUEUE_ID, MQ_CTL_SET_LATENCY, 1ul))
+    {
+        LOG("msg_queue_ctl system call returned error.");
+        return -1;
+    }
+
+    child = fork();
+    if (0 == child)
+    {
+        for (i = 0u; i < MESSAGES; i++)
+        {
+            msg_receive_syscall(QUEUE_ID, buffer, &length);
+            msg_ack_syscall(QUEUE_ID);
+        }
+        return 0;
+    }
+
+    for (i = 0u; i < MESSAGES; i++)
+    {
+        msg_send_syscall(QUEUE_ID, buffer, 64u);
+    }
+    waitpid(child, NULL, 0);
+
+    file = fopen("/proc/messagequeue/latency", "r");
+    if (file == NULL)
+    {
+        LOG("Could not open /proc/messagequeue/latency.");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *cursor = line;
+        int used = 0;
+
+        if ((2 != sscanf(cursor, "%u %15s%n", &queueId, name, &used)) || (QUEUE_ID != queueId))
+        {
+            continue;
+        }
+
+        for (i = 0u; i < BUCKETS; i++)
+        {
+            cursor += used;
+            if (1 != sscanf(cursor, "%llu%n", &counts[i], &used))
+            {
+                break;
+            }
+        }
+
+        if (BUCKETS == i)
+        {
+            print_percentiles(name, counts);
+        }
+    }
+
+    fclose(file);
+    delete_queue_syscall(QUEUE_ID);
+
+    return 0;
+}
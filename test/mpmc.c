@@ -0,0 +1,153 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive_batch 469
+
+#define E_OK 0x0
+
+#define QUEUE_ID 3u
+#define QUEUE_DEPTH 256u
+#define MESSAGES_PER_PRODUCER 100000u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+struct MessageVector
+{
+    char *buffer;
+    unsigned int capacity;
+    unsigned int length;
+};
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_send_syscall(unsigned int queueId, char *message, unsigned int length)
+{
+ return syscall(__NR_msg_send, queueId, message, length);
+}
+
+long msg_receive_batch_syscall(unsigned int queueId, struct MessageVector *vector, unsigned int count, unsigned int *received)
+{
+ return syscall(__NR_msg_receive_batch, queueId, vector, count, received);
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Consumers print how many messages they got and stop on an empty one. */
+static int consume(void)
+{
+    char buffer[64];
+    struct MessageVector entry = {buffer, sizeof(buffer), 0u};
+    unsigned int received;
+    unsigned long count = 0ul;
+
+    for (;;)
+    {
+        if (E_OK != msg_receive_batch_syscall(QUEUE_ID, &entry, 1u, &received))
+        {
+            perror("msg_receive_batch");
+            return 255;
+        }
+        if (0u == entry.length)
+        {
+            break;
+        }
+        count++;
+    }
+
+    printf("consumer %d: %lu messages\n", (int)getpid(), count);
+    return 0;
+}
+
+static int produce(void)
+{
+    char message[16] = "payload";
+    unsigned int i;
+
+    for (i = 0u; i < MESSAGES_PER_PRODUCER; i++)
+    {
+        if (E_OK != msg_send_syscall(QUEUE_ID, message, sizeof(message)))
+        {
+            perror("msg_send");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Usage: mpmc [producers] [consumers]. Prints total throughput. */
+int main(int argc, char *argv[])
+{
+    unsigned int producers = (argc > 1) ? (unsigned int)atoi(argv[1]) : 4u;
+    unsigned int consumers = (argc > 2) ? (unsigned int)atoi(argv[2]) : 4u;
+    unsigned int i;
+    int status;
+
+    if (E_OK != create_queue_syscall(QUEUE_ID, QUEUE_DEPTH, 0u))
+    {
+        perror("create_queue");
+        return -1;
+    }
+
+    double start = now_s();
+
+    for (i = 0u; i < consumers; i++)
+    {
+        if (0 == fork())
+        {
+            exit(consume());
+        }
+    }
+
+    for (i = 0u; i < producers; i++)
+    {
+        if (0 == fork())
+        {
+            exit(produce());
+        }
+    }
+
+    /* Wait for the producers, then tell every consumer to stop. */
+    for (i = 0u; i < producers; i++)
+    {
+        wait(&status);
+    }
+    for (i = 0u; i < consumers; i++)
+    {
+        msg_send_syscall(QUEUE_ID, "", 0u);
+    }
+    while (wait(&status) > 0)
+    {
+    }
+
+    double elapsed = now_s() - start;
+    printf("%u producers, %u consumers: %.0f messages/s\n", producers, consumers,
+           (double)producers * MESSAGES_PER_PRODUCER / elapsed);
+
+    delete_queue_syscall(QUEUE_ID);
+
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * User-space fast path for queues created with MQ_FLAG_SHARED.
+ *
+ * One producer and one consumer exchange messages through the mapped ring
+ * without entering the kernel. A side only calls msg_ring_notify to sleep
+ * after spinning on an empty (or full) ring for MQ_RING_SPIN rounds, and
+ * only wakes its peer when the header shows the peer is asleep.
+ */
+#ifndef MQ_RING_H
+#define MQ_RING_H
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#define __NR_msg_open 470
+#define __NR_msg_ring_notify 471
+
+#define MQ_FLAG_SHARED 0x2u
+
+#define MQ_RING_WAIT_DATA 0u
+#define MQ_RING_WAIT_SPACE 1u
+#define MQ_RING_WAKE_CONSUMER 2u
+#define MQ_RING_WAKE_PRODUCER 3u
+
+#define MQ_RING_SPIN 2000u
+
+struct MessageRingHeader
+{
+    uint32_t magic;
+    uint32_t slotSize;
+    uint32_t slotCount;
+    uint32_t dataOffset;
+    uint32_t reserved0[12];
+    uint32_t producer;
+    uint32_t producerWaiters;
+    uint32_t reserved1[14];
+    uint32_t consumer;
+    uint32_t consumerWaiters;
+    uint32_t reserved2[14];
+};
+
+struct MessageRingSlot
+{
+    uint32_t length;
+    uint32_t reserved;
+};
+
+typedef struct
+{
+    unsigned int queueId;
+    int fd;
+    struct MessageRingHeader * ring;
+    size_t size;
+} MessageRing;
+
+static inline void mq_ring_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* slotCount is a power of two, so masking stays correct when the indices wrap. */
+static inline struct MessageRingSlot * mq_ring_slot(struct MessageRingHeader * ring, uint32_t index)
+{
+    return (struct MessageRingSlot *)((char *)ring + ring->dataOffset + (size_t)(index & (ring->slotCount - 1u)) * ring->slotSize);
+}
+
+/* Maps the ring of an existing MQ_FLAG_SHARED queue. Returns 0 on success. */
+static inline int mq_ring_attach(MessageRing * r, unsigned int queueId)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    struct MessageRingHeader * header;
+
+    r->queueId = queueId;
+    r->fd = (int)syscall(__NR_msg_open, queueId, 0u);
+    if (r->fd < 0)
+    {
+        return -1;
+    }
+
+    header = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (header == MAP_FAILED)
+    {
+        close(r->fd);
+        return -1;
+    }
+    r->size = header->dataOffset + (size_t)header->slotCount * header->slotSize;
+    munmap(header, pageSize);
+
+    r->ring = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->ring == MAP_FAILED)
+    {
+        close(r->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void mq_ring_detach(MessageRing * r)
+{
+    munmap(r->ring, r->size);
+    close(r->fd);
+}
+
+/* Single producer. Returns 0 on success, -1 if the message is too large or the wait failed. */
+static inline int mq_ring_send(MessageRing * r, const void * data, uint32_t length)
+{
+    struct MessageRingHeader * ring = r->ring;
+    uint32_t producer = __atomic_load_n(&ring->producer, __ATOMIC_RELAXED);
+    uint32_t consumer;
+    unsigned int spins = 0u;
+
+    if (length > ring->slotSize - sizeof(struct MessageRingSlot))
+    {
+        return -1;
+    }
+
+    while (producer - (consumer = __atomic_load_n(&ring->consumer, __ATOMIC_ACQUIRE)) >= ring->slotCount)
+    {
+        if (++spins < MQ_RING_SPIN)
+        {
+            mq_ring_pause();
+        }
+        else if (0 != syscall(__NR_msg_ring_notify, r->queueId, MQ_RING_WAIT_SPACE, consumer))
+        {
+            return -1;
+        }
+    }
+
+    struct MessageRingSlot * slot = mq_ring_slot(ring, producer);
+    slot->length = length;
+    memcpy(slot + 1, data, length);
+
+    __atomic_store_n(&ring->producer, producer + 1u, __ATOMIC_RELEASE);
+
+    /* Pairs with the barrier the kernel issues after counting a sleeper. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (0u != __atomic_load_n(&ring->consumerWaiters, __ATOMIC_RELAXED))
+    {
+        syscall(__NR_msg_ring_notify, r->queueId, MQ_RING_WAKE_CONSUMER, 0u);
+    }
+
+    return 0;
+}
+
+/* Single consumer. Returns 0 on success, -1 if the message is too large or the wait failed. */
+static inline int mq_ring_receive(MessageRing * r, void * data, uint32_t capacity, uint32_t * length)
+{
+    struct MessageRingHeader * ring = r->ring;
+    uint32_t consumer = __atomic_load_n(&ring->consumer, __ATOMIC_RELAXED);
+    uint32_t producer;
+    unsigned int spins = 0u;
+
+    while ((producer = __atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE)) == consumer)
+    {
+        if (++spins < MQ_RING_SPIN)
+        {
+            mq_ring_pause();
+        }
+        else if (0 != syscall(__NR_msg_ring_notify, r->queueId, MQ_RING_WAIT_DATA, producer))
+        {
+            return -1;
+        }
+    }
+
+    /* Read the length once; the peer could change it between checking and copying. */
+    struct MessageRingSlot * slot = mq_ring_slot(ring, consumer);
+    uint32_t len = __atomic_load_n(&slot->length, __ATOMIC_RELAXED);
+    if (len > capacity)
+    {
+        return -1;
+    }
+    memcpy(data, slot + 1, len);
+    *length = len;
+
+    __atomic_store_n(&ring->consumer, consumer + 1u, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (0u != __atomic_load_n(&ring->producerWaiters, __ATOMIC_RELAXED))
+    {
+        syscall(__NR_msg_ring_notify, r->queueId, MQ_RING_WAKE_PRODUCER, 0u);
+    }
+
+    return 0;
+}
+
+#endif
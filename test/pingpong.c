@@ -0,0 +1,120 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+
+#define E_OK 0x0
+
+#define REQUEST_QUEUE 5u
+#define RESPONSE_QUEUE 6u
+#define MESSAGE_MAX 256u
+#define ROUND_TRIPS 100000u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_send_syscall(unsigned int queueId, char *message, unsigned int length)
+{
+ return syscall(__NR_msg_send, queueId, message, length);
+}
+
+long msg_receive_syscall(unsigned int queueId, char *buffer, unsigned int *length)
+{
+ return syscall(__NR_msg_receive, queueId, buffer, length);
+}
+
+long msg_ack_syscall(unsigned int queueId)
+{
+ return syscall(__NR_msg_ack, queueId, 0ul);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * Usage: pingpong [bytes]. A child echoes every request back on the
+ * response queue. Each side is usually already blocked in msg_receive when
+ * the other sends, so messages take the direct handoff path.
+ */
+int main(int argc, char *argv[])
+{
+    unsigned int size = (argc > 1) ? (unsigned int)strtoul(argv[1], NULL, 0) : 64u;
+    char buffer[MESSAGE_MAX] = {0};
+    unsigned int length = 0u;
+    unsigned int i;
+    pid_t child;
+
+    if (size > MESSAGE_MAX)
+    {
+        size = MESSAGE_MAX;
+    }
+
+    if ((E_OK != create_queue_syscall(REQUEST_QUEUE, 0u, 0u)) ||
+        (E_OK != create_queue_syscall(RESPONSE_QUEUE, 0u, 0u)))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    child = fork();
+    if (0 == child)
+    {
+        for (i = 0u; i < ROUND_TRIPS; i++)
+        {
+            if (E_OK != msg_receive_syscall(REQUEST_QUEUE, buffer, &length))
+            {
+                LOG("msg_receive system call returned error.");
+                return 1;
+            }
+            msg_ack_syscall(REQUEST_QUEUE);
+            msg_send_syscall(RESPONSE_QUEUE, buffer, length);
+        }
+        return 0;
+    }
+
+    double start = now_ns();
+    for (i = 0u; i < ROUND_TRIPS; i++)
+    {
+        if ((E_OK != msg_send_syscall(REQUEST_QUEUE, buffer, size)) ||
+            (E_OK != msg_receive_syscall(RESPONSE_QUEUE, buffer, &length)))
+        {
+            LOG("Round trip failed.");
+            break;
+        }
+        msg_ack_syscall(RESPONSE_QUEUE);
+    }
+    double elapsed = now_ns() - start;
+
+    printf("bytes,round_trips,ns_per_round_trip\n");
+    printf("%u,%u,%.1f\n", size, i, elapsed / i);
+
+    waitpid(child, NULL, 0);
+    delete_queue_syscall(REQUEST_QUEUE);
+    delete_queue_syscall(RESPONSE_QUEUE);
+
+    return 0;
+}
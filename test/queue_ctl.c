@@ -0,0 +1,63 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_msg_queue_ctl 472
+
+#define E_OK 0x0
+#define E_NOK 0xFF
+
+#define MQ_CTL_SET_WINDOW 1u
+#define MQ_CTL_GET_WINDOW 2u
+
+#define QUEUE_ID 1u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_queue_ctl_syscall(unsigned int queueId, unsigned int cmd, unsigned long arg)
+{
+ return syscall(__NR_msg_queue_ctl, queueId, cmd, arg);
+}
+
+/* Usage: queue_ctl [window]. Sets the credit window if given, then prints it. */
+int main(int argc, char *argv[])
+{
+    unsigned int window = 0u;
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 0u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    if (argc > 1)
+    {
+        LOG("Setting window.");
+        if (E_OK != msg_queue_ctl_syscall(QUEUE_ID, MQ_CTL_SET_WINDOW, strtoul(argv[1], NULL, 0)))
+        {
+            LOG("msg_queue_ctl system call returned error.");
+            return -1;
+        }
+    }
+
+    if (E_OK != msg_queue_ctl_syscall(QUEUE_ID, MQ_CTL_GET_WINDOW, (unsigned long)&window))
+    {
+        LOG("msg_queue_ctl system call returned error.");
+        return -1;
+    }
+
+    printf(">>> Window: %u\n", window);
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+
+#define E_OK 0x0
+
+#define QUEUE_ID 7u
+#define MESSAGE_MAX 256u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_send_syscall(unsigned int queueId, char *message, unsigned int length)
+{
+ return syscall(__NR_msg_send, queueId, message, length);
+}
+
+long msg_receive_syscall(unsigned int queueId, char *buffer, unsigned int *length)
+{
+ return syscall(__NR_msg_receive, queueId, buffer, length);
+}
+
+long msg_ack_syscall(unsigned int queueId)
+{
+ return syscall(__NR_msg_ack, queueId, 0ul);
+}
+
+/* Prints the header and this queue's line of /proc/messagequeue/queues. */
+static void print_queue_stats(void)
+{
+    char line[512];
+    unsigned int queueId;
+    FILE *file = fopen("/proc/messagequeue/queues", "r");
+
+    if (file == NULL)
+    {
+        LOG("Could not open /proc/messagequeue/queues.");
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if ((1 != sscanf(line, "%u", &queueId)) || (QUEUE_ID == queueId))
+        {
+            fputs(line, stdout);
+        }
+    }
+
+    fclose(file);
+}
+
+/*
+ * Sends four messages, receives three and acknowledges two, printing the
+ * queue's counters after each step.
+ */
+int main(int argc, char *argv[])
+{
+    char buffer[MESSAGE_MAX] = {0};
+    unsigned int length = 0u;
+    unsigned int i;
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 8u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    for (i = 0u; i < 4u; i++)
+    {
+        msg_send_syscall(QUEUE_ID, "statistics", 10u);
+    }
+    print_queue_stats();
+
+    for (i = 0u; i < 3u; i++)
+    {
+        msg_receive_syscall(QUEUE_ID, buffer, &length);
+    }
+    print_queue_stats();
+
+    msg_ack_syscall(QUEUE_ID);
+    msg_ack_syscall(QUEUE_ID);
+    print_queue_stats();
+
+    delete_queue_syscall(QUEUE_ID);
+
+    return 0;
+}
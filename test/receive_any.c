@@ -0,0 +1,103 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_msg_send 465
+#define __NR_msg_ack 467
+#define __NR_queue_set_ctl 475
+#define __NR_msg_receive_any 476
+
+#define E_OK 0x0
+
+#define MQ_SET_CREATE 1u
+#define MQ_SET_DESTROY 2u
+#define MQ_SET_ADD 3u
+
+#define MESSAGE_MAX 256
+#define SET_ID 1u
+#define QUEUE_BASE 32u
+#define QUEUE_COUNT 8u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_send_syscall(unsigned int queueId, char *message, unsigned int length)
+{
+ return syscall(__NR_msg_send, queueId, message, length);
+}
+
+long msg_ack_syscall(unsigned int queueId, unsigned long sequence)
+{
+ return syscall(__NR_msg_ack, queueId, sequence);
+}
+
+long queue_set_ctl_syscall(unsigned int setId, unsigned int cmd, unsigned int queueId)
+{
+ return syscall(__NR_queue_set_ctl, setId, cmd, queueId);
+}
+
+long msg_receive_any_syscall(unsigned int setId, char *buffer, unsigned int *length, unsigned int *queueId)
+{
+ return syscall(__NR_msg_receive_any, setId, buffer, length, queueId);
+}
+
+/*
+ * Puts QUEUE_COUNT queues (ids 32..39) in one set, sends a message to each
+ * and receives them all from the set in a single thread.
+ */
+int main(int argc, char *argv[])
+{
+    char buffer[MESSAGE_MAX + 1];
+    unsigned int length;
+    unsigned int source;
+    unsigned int i;
+
+    LOG("Creating queue set.");
+    if (E_OK != queue_set_ctl_syscall(SET_ID, MQ_SET_CREATE, 0u))
+    {
+        perror("queue_set_ctl");
+        return -1;
+    }
+
+    for (i = 0u; i < QUEUE_COUNT; i++)
+    {
+        if ((E_OK != create_queue_syscall(QUEUE_BASE + i, 0u, 0u)) ||
+            (E_OK != queue_set_ctl_syscall(SET_ID, MQ_SET_ADD, QUEUE_BASE + i)))
+        {
+            perror("adding queue to set");
+            return -1;
+        }
+
+        snprintf(buffer, sizeof(buffer), "message for queue %u", QUEUE_BASE + i);
+        if (E_OK != msg_send_syscall(QUEUE_BASE + i, buffer, strlen(buffer) + 1u))
+        {
+            perror("msg_send");
+            return -1;
+        }
+    }
+
+    for (i = 0u; i < QUEUE_COUNT; i++)
+    {
+        if (E_OK != msg_receive_any_syscall(SET_ID, buffer, &length, &source))
+        {
+            perror("msg_receive_any");
+            return -1;
+        }
+
+        printf(">>> Queue %u: %s\n", source, buffer);
+        msg_ack_syscall(source, 0ul);
+    }
+
+    queue_set_ctl_syscall(SET_ID, MQ_SET_DESTROY, 0u);
+
+    return 0;
+}
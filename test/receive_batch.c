@@ -0,0 +1,77 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+#define __NR_msg_send_batch 468
+#define __NR_msg_receive_batch 469
+
+#define E_OK 0x0
+#define E_NOK 0xFF
+
+#define QUEUE_ID 1u
+#define BATCH_SIZE 8u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+struct MessageVector
+{
+    char * buffer;
+    unsigned int capacity;
+    unsigned int length;
+};
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_receive_batch_syscall(unsigned int queueId, struct MessageVector * vector, unsigned int count, unsigned int * received)
+{
+ return syscall(__NR_msg_receive_batch, queueId, vector, count, received);
+}
+
+int main(int argc, char *argv[])
+{
+    char buffers[BATCH_SIZE][100];
+    struct MessageVector vector[BATCH_SIZE];
+    unsigned int received = 0u;
+    unsigned int i;
+
+    memset(buffers, 0, sizeof(buffers));
+    for (i = 0u; i < BATCH_SIZE; i++)
+    {
+        vector[i].buffer = buffers[i];
+        vector[i].capacity = sizeof(buffers[i]) - 1u;
+        vector[i].length = 0u;
+    }
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 0u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    LOG("Receiving batch.");
+    if (E_OK != msg_receive_batch_syscall(QUEUE_ID, vector, BATCH_SIZE, &received))
+    {
+        LOG("msg_receive_batch system call returned error.");
+        return -1;
+    }
+
+    for (i = 0u; i < received; i++)
+    {
+        printf(">>> Received message (len:%u): %s\n", vector[i].length, vector[i].buffer);
+    }
+
+    return 0;
+}
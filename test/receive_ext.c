@@ -0,0 +1,97 @@
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_msg_ack 467
+#define __NR_msg_receive_ext 477
+
+#define E_OK 0x0
+
+#define MESSAGE_MAX 256
+#define QUEUE_ID 1u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+struct MessageInfo
+{
+    __u64 enqueueTime;
+    __u64 sequence;
+    __u64 ackSequence;
+    __u32 length;
+    __u32 priority;
+    __s32 tgid;
+    __u32 shard;
+};
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_ack_syscall(unsigned int queueId, unsigned long sequence)
+{
+ return syscall(__NR_msg_ack, queueId, sequence);
+}
+
+long msg_receive_ext_syscall(unsigned int queueId, char *buffer, unsigned int capacity, struct MessageInfo *info, const struct timespec *absTimeout)
+{
+ return syscall(__NR_msg_receive_ext, queueId, buffer, capacity, info, absTimeout);
+}
+
+/*
+ * Usage: receive_ext [count]. Receives count messages, 1 by default, and
+ * prints each one's metadata along with the time it spent queued. A jump in
+ * the sequence numbers means messages were taken by another receiver. Each
+ * message is acknowledged by its ackSequence once printed.
+ */
+int main(int argc, char *argv[])
+{
+    char buffer[MESSAGE_MAX + 1];
+    struct MessageInfo info;
+    struct timespec now;
+    unsigned long count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1ul;
+    unsigned long i;
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 0u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    for (i = 0ul; i < count; i++)
+    {
+        memset(buffer, 0, sizeof(buffer));
+        if (E_OK != msg_receive_ext_syscall(QUEUE_ID, buffer, MESSAGE_MAX, &info, NULL))
+        {
+            LOG("msg_receive_ext system call returned error.");
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        printf(">>> seq %llu from pid %d, %u bytes at priority %u", (unsigned long long)info.sequence, info.tgid,
+               info.length, info.priority);
+        if (info.enqueueTime != 0u)
+        {
+            unsigned long long nowNs = (unsigned long long)now.tv_sec * 1000000000ull + (unsigned long long)now.tv_nsec;
+            printf(", queued %llu ns", nowNs - (unsigned long long)info.enqueueTime);
+        }
+        printf(": %s\n", buffer);
+
+        /* Sharded queues and shared rings report 0 and need no ack. */
+        if ((info.ackSequence != 0u) && (E_OK != msg_ack_syscall(QUEUE_ID, (unsigned long)info.ackSequence)))
+        {
+            LOG("msg_ack system call returned error.");
+            return -1;
+        }
+    }
+
+    return 0;
+}
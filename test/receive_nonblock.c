@@ -0,0 +1,90 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_msg_receive 466
+#define __NR_msg_queue_ctl 472
+#define __NR_msg_receive_timed 474
+
+#define E_OK 0x0
+
+#define MQ_CTL_SET_NONBLOCK 3u
+
+#define MESSAGE_MAX 256
+#define QUEUE_ID 1u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_receive_syscall(unsigned int queueId, char *buffer, unsigned int *length)
+{
+ return syscall(__NR_msg_receive, queueId, buffer, length);
+}
+
+long msg_queue_ctl_syscall(unsigned int queueId, unsigned int cmd, unsigned long arg)
+{
+ return syscall(__NR_msg_queue_ctl, queueId, cmd, arg);
+}
+
+long msg_receive_timed_syscall(unsigned int queueId, char *buffer, unsigned int *length, unsigned int *priority, const struct timespec *absTimeout)
+{
+ return syscall(__NR_msg_receive_timed, queueId, buffer, length, priority, absTimeout);
+}
+
+/*
+ * Usage: receive_nonblock [queue]. Polls once with a zero deadline, or with
+ * "queue" switches the whole queue to non-blocking and uses msg_receive.
+ */
+int main(int argc, char *argv[])
+{
+    char buffer[MESSAGE_MAX + 1] = {0};
+    unsigned int length = 0u;
+    struct timespec poll = {0, 0};
+    long status;
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 0u, 0u))
+    {
+        perror("create_queue");
+        return -1;
+    }
+
+    if ((argc > 1) && (0 == strcmp(argv[1], "queue")))
+    {
+        if (E_OK != msg_queue_ctl_syscall(QUEUE_ID, MQ_CTL_SET_NONBLOCK, 1ul))
+        {
+            perror("msg_queue_ctl");
+            return -1;
+        }
+        status = msg_receive_syscall(QUEUE_ID, buffer, &length);
+    }
+    else
+    {
+        status = msg_receive_timed_syscall(QUEUE_ID, buffer, &length, NULL, &poll);
+    }
+
+    if ((-1 == status) && (EAGAIN == errno))
+    {
+        LOG("Queue is empty.");
+        return 1;
+    }
+    if (E_OK != status)
+    {
+        perror("msg_receive");
+        return -1;
+    }
+
+    printf(">>> Received %u bytes: %s\n", length, buffer);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_msg_receive_timed 474
+
+#define E_OK 0x0
+
+#define MESSAGE_MAX 256
+#define QUEUE_ID 1u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_receive_timed_syscall(unsigned int queueId, char *buffer, unsigned int *length, unsigned int *priority, const struct timespec *absTimeout)
+{
+ return syscall(__NR_msg_receive_timed, queueId, buffer, length, priority, absTimeout);
+}
+
+/* Usage: receive_timed [milliseconds]. Waits up to the given time, 1000 by default. */
+int main(int argc, char *argv[])
+{
+    char buffer[MESSAGE_MAX + 1] = {0};
+    unsigned int length = 0u;
+    unsigned int priority = 0u;
+    unsigned long ms = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000ul;
+    struct timespec deadline;
+    long status;
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 0u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000ul;
+    deadline.tv_nsec += (long)(ms % 1000ul) * 1000000l;
+    if (deadline.tv_nsec >= 1000000000l)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000l;
+    }
+
+    status = msg_receive_timed_syscall(QUEUE_ID, buffer, &length, &priority, &deadline);
+    if ((-1 == status) && (ETIMEDOUT == errno))
+    {
+        LOG("No message before the deadline.");
+        return 1;
+    }
+    if (E_OK != status)
+    {
+        LOG("msg_receive_timed system call returned error.");
+        return -1;
+    }
+
+    printf(">>> Received %u bytes at priority %u: %s\n", length, priority, buffer);
+
+    return 0;
+}
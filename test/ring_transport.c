@@ -0,0 +1,84 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "mq_ring.h"
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+
+#define E_OK 0x0
+#define E_NOK 0xFF
+
+#define QUEUE_ID 2u
+#define MESSAGE_COUNT 100u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+int main(int argc, char *argv[])
+{
+    MessageRing ring;
+    char text[64];
+    uint32_t length;
+    unsigned int i;
+
+    LOG("Creating shared queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 8u, MQ_FLAG_SHARED))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    if (0 != mq_ring_attach(&ring, QUEUE_ID))
+    {
+        LOG("Mapping ring failed.");
+        return -1;
+    }
+
+    if (fork() == 0)
+    {
+        for (i = 0u; i < MESSAGE_COUNT; i++)
+        {
+            if (0 != mq_ring_receive(&ring, text, sizeof(text), &length))
+            {
+                LOG("Receiving from ring failed.");
+                return -1;
+            }
+        }
+        printf(">>> Last message (len:%u): %s\n", length, text);
+        return 0;
+    }
+
+    for (i = 0u; i < MESSAGE_COUNT; i++)
+    {
+        snprintf(text, sizeof(text), "message %u", i);
+        if (0 != mq_ring_send(&ring, text, strlen(text) + 1u))
+        {
+            LOG("Sending to ring failed.");
+            break;
+        }
+    }
+
+    wait(NULL);
+
+    LOG("Deleting queue.");
+    mq_ring_detach(&ring);
+    delete_queue_syscall(QUEUE_ID);
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+#define __NR_msg_send_batch 468
+
+#define E_OK 0x0
+#define E_NOK 0xFF
+
+#define QUEUE_ID 1u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+struct MessageDescriptor
+{
+    unsigned int queueId;
+    unsigned int length;
+    char * message;
+    int status;
+    unsigned int reserved;
+};
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_send_batch_syscall(struct MessageDescriptor * descriptors, unsigned int count)
+{
+ return syscall(__NR_msg_send_batch, descriptors, count);
+}
+
+int main(int argc, char *argv[])
+{
+    char * defaultMessages[] = {"hello", "there", "from", "a", "batch"};
+    struct MessageDescriptor descriptors[16];
+    char ** messages = defaultMessages;
+    unsigned int count = sizeof(defaultMessages) / sizeof(defaultMessages[0]);
+    unsigned int i;
+
+    if (argc > 1)
+    {
+        messages = &argv[1];
+        count = (unsigned int)(argc - 1);
+        if (count > 16u)
+        {
+            count = 16u;
+        }
+    }
+
+    for (i = 0u; i < count; i++)
+    {
+        descriptors[i].queueId = QUEUE_ID;
+        descriptors[i].length = strlen(messages[i]) + 1u;
+        descriptors[i].message = messages[i];
+        descriptors[i].status = -EINVAL;
+        descriptors[i].reserved = 0u;
+    }
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 0u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    LOG("Sending batch.");
+    long status = msg_send_batch_syscall(descriptors, count);
+
+    for (i = 0u; i < count; i++)
+    {
+        printf("entry %u (%s): %s\n", i, messages[i], (E_OK == descriptors[i].status) ? "sent" : strerror(-descriptors[i].status));
+    }
+
+    return (E_OK == status) ? 0 : -1;
+}
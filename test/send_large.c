@@ -0,0 +1,118 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_send 465
+#define __NR_msg_receive 466
+#define __NR_msg_ack 467
+
+#define E_OK 0x0
+
+#define QUEUE_ID 4u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long delete_queue_syscall(unsigned int queueId)
+{
+ return syscall(__NR_delete_queue, queueId);
+}
+
+long msg_send_syscall(unsigned int queueId, char *message, unsigned int length)
+{
+ return syscall(__NR_msg_send, queueId, message, length);
+}
+
+long msg_receive_syscall(unsigned int queueId, char *buffer, unsigned int *length)
+{
+ return syscall(__NR_msg_receive, queueId, buffer, length);
+}
+
+long msg_ack_syscall(unsigned int queueId)
+{
+ return syscall(__NR_msg_ack, queueId, 0ul);
+}
+
+/*
+ * Usage: send_large [megabytes]. A child process receives one message of
+ * the given size, 16 MB by default, and checks its contents. The parent's
+ * msg_send returns once the child has copied it out of the parent's pages.
+ */
+int main(int argc, char *argv[])
+{
+    unsigned int size = ((argc > 1) ? (unsigned int)strtoul(argv[1], NULL, 0) : 16u) << 20;
+    unsigned int length = 0u;
+    unsigned int i;
+    int childStatus = 0;
+    char *buffer;
+    pid_t child;
+
+    buffer = malloc(size);
+    if (buffer == NULL)
+    {
+        LOG("Could not allocate the message buffer.");
+        return -1;
+    }
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 1u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    child = fork();
+    if (0 == child)
+    {
+        memset(buffer, 0, size);
+        if (E_OK != msg_receive_syscall(QUEUE_ID, buffer, &length))
+        {
+            LOG("msg_receive system call returned error.");
+            return 1;
+        }
+        msg_ack_syscall(QUEUE_ID);
+
+        for (i = 0u; i < size; i++)
+        {
+            if (buffer[i] != (char)(i * 7u))
+            {
+                LOG("Message contents differ.");
+                return 1;
+            }
+        }
+
+        printf(">>> Received %u bytes intact\n", length);
+        return (length == size) ? 0 : 1;
+    }
+
+    for (i = 0u; i < size; i++)
+    {
+        buffer[i] = (char)(i * 7u);
+    }
+
+    if (E_OK != msg_send_syscall(QUEUE_ID, buffer, size))
+    {
+        LOG("msg_send system call returned error.");
+    }
+    else
+    {
+        LOG("Message was received.");
+    }
+
+    waitpid(child, &childStatus, 0);
+    delete_queue_syscall(QUEUE_ID);
+    free(buffer);
+
+    return WEXITSTATUS(childStatus);
+}
@@ -0,0 +1,103 @@
+#include <linux/kernel.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define __NR_create_queue 463
+#define __NR_delete_queue 464
+#define __NR_msg_ack 467
+#define __NR_msg_send_timed 473
+#define __NR_msg_receive_timed 474
+
+#define E_OK 0x0
+
+#define QUEUE_ID 1u
+#define MESSAGE_MAX 64u
+
+#define PRIO_BULK 0u
+#define PRIO_CONTROL 31u
+
+#define LOG(m) printf("%s: %d : %s\n", __FILE__, __LINE__, m)
+
+long create_queue_syscall(unsigned int queueId, unsigned int depth, unsigned int flags)
+{
+ return syscall(__NR_create_queue, queueId, depth, flags);
+}
+
+long msg_ack_syscall(unsigned int queueId)
+{
+ return syscall(__NR_msg_ack, queueId, 0ul);
+}
+
+long msg_send_timed_syscall(unsigned int queueId, char *message, unsigned int length, unsigned int priority, const struct timespec *absTimeout)
+{
+ return syscall(__NR_msg_send_timed, queueId, message, length, priority, absTimeout);
+}
+
+long msg_receive_timed_syscall(unsigned int queueId, char *buffer, unsigned int *length, unsigned int *priority, const struct timespec *absTimeout)
+{
+ return syscall(__NR_msg_receive_timed, queueId, buffer, length, priority, absTimeout);
+}
+
+/*
+ * Queues three bulk messages and then two control messages, and drains the
+ * queue without waiting. The control messages come out first, in the order
+ * they were sent, followed by the bulk ones.
+ */
+int main(int argc, char *argv[])
+{
+    char * bulk[] = {"bulk 1", "bulk 2", "bulk 3"};
+    char * control[] = {"control 1", "control 2"};
+    struct timespec poll = {0, 0};
+    char buffer[MESSAGE_MAX + 1];
+    unsigned int length;
+    unsigned int priority;
+    unsigned int i;
+
+    LOG("Getting queue.");
+    if (E_OK != create_queue_syscall(QUEUE_ID, 8u, 0u))
+    {
+        LOG("create_queue system call returned error.");
+        return -1;
+    }
+
+    for (i = 0u; i < sizeof(bulk) / sizeof(bulk[0]); i++)
+    {
+        if (E_OK != msg_send_timed_syscall(QUEUE_ID, bulk[i], strlen(bulk[i]), PRIO_BULK, &poll))
+        {
+            LOG("msg_send_timed system call returned error.");
+            return -1;
+        }
+    }
+    for (i = 0u; i < sizeof(control) / sizeof(control[0]); i++)
+    {
+        if (E_OK != msg_send_timed_syscall(QUEUE_ID, control[i], strlen(control[i]), PRIO_CONTROL, &poll))
+        {
+            LOG("msg_send_timed system call returned error.");
+            return -1;
+        }
+    }
+
+    for (;;)
+    {
+        memset(buffer, 0, sizeof(buffer));
+        length = MESSAGE_MAX;
+        if (E_OK != msg_receive_timed_syscall(QUEUE_ID, buffer, &length, &priority, &poll))
+        {
+            break;
+        }
+        printf(">>> Received priority %u: %s\n", priority, buffer);
+        msg_ack_syscall(QUEUE_ID);
+    }
+    if (EAGAIN != errno)
+    {
+        LOG("msg_receive_timed system call returned error.");
+        return -1;
+    }
+
+    return 0;
+}